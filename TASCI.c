@@ -13,6 +13,8 @@
 */
 
 #define _POSIX_C_SOURCE 200809L
+/* d_type / DT_* from <dirent.h> */
+#define _DEFAULT_SOURCE
 
 #include <ncurses.h>
 #include <dirent.h>
@@ -28,6 +30,8 @@
 #include <termios.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 void draw_menu();
 void draw_tabs();
@@ -36,6 +40,7 @@ void draw_editor();
 void draw_status(const char *msg);
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <signal.h>
 #ifdef __linux__
 #include <linux/limits.h>
@@ -49,33 +54,51 @@ void draw_status(const char *msg);
 #include "syntax_highlighting.h"
 #include "lsp_autocomplete.h"
 #include "colours_fix.h"
+#include "trace.h"
 
 #define MAX_FILES 512
 #define MAX_LINE 1024
 #define CLIP_CAP (1024 * 1024)
 #define SIDEBAR 30
 #define MENU_ITEMS 12
-#define MAIN_LOOP_TIMEOUT_MS 100
+#define BLINK_INTERVAL_MS 500
+#define STATUS_MSG_SECONDS 5
+#define INPUT_BATCH_MAX 4096
 
 enum Mode { MODE_EXPLORER, MODE_EDITOR, MODE_MENU, MODE_TABS, MODE_DIALOG };
 enum Mode mode = MODE_EXPLORER;
 
 /* ---------- STATE ---------- */
 char cwd[PATH_MAX];
-char files[MAX_FILES][256];
+/* One explorer entry. The type comes from readdir's d_type (or a single
+   fstatat when the filesystem doesn't report it), so listing a directory
+   costs no per-entry syscalls. The preview stats the file it shows. */
+typedef struct {
+    char name[256];
+    int is_dir;
+} DirEntry;
+
+DirEntry files[MAX_FILES];
+static int preview_sel = -1;   /* entry the preview pane was last requested for */
 int file_count = 0, sel = 0;
 int file_off = 0;
 
 char **buf = NULL;
 int buf_cap = 0;
 int lines = 1, cx = 0, cy = 0;
-char current_file[256] = "";
+char current_file[PATH_MAX] = "";   /* absolute once loaded; see path_canonical() */
+/* Where current_file was opened from, as an absolute path: the root its
+   language server is started for. Fixed when the file is opened, so
+   browsing elsewhere does not move the tab to another server. */
+static char current_root[PATH_MAX] = "";
 int rowoff = 0, coloff = 0;
+int rowoff_sub = 0;   /* soft wrap: first visual row of line rowoff on screen */
 int is_dirty = 0;
 
 #define MAX_TABS 16
 typedef struct {
     char path[PATH_MAX];
+    char root[PATH_MAX];
     char **buf;
     int buf_cap;
     int lines;
@@ -101,6 +124,13 @@ const char *menu_items[MENU_ITEMS] = {
 };
 
 int blink_on = 1;
+
+/* Cursor blink styles. Soft blinking flips one cell in ncurses; the terminal
+   style hands the cursor to the terminal (DECSCUSR) and never redraws. */
+enum { CURSOR_BLINK_OFF = 0, CURSOR_BLINK_SOFT = 1, CURSOR_BLINK_TERMINAL = 2 };
+int cursor_blink = CURSOR_BLINK_SOFT;
+static int cursor_blink_chosen = 0; /* set once the user picks a style */
+static int hw_cursor_state = -1; /* last curs_set() value, -1 = unknown */
 static struct termios saved_termios;
 static int termios_saved = 0;
 
@@ -170,6 +200,156 @@ int sidebar_on_right = 0;
 char status_msg[256] = "TASCI Ready - Ctrl+X to exit";
 time_t status_time = 0;
 
+/* ---------- RENDER (damage tracking) ---------- */
+/* Windows are only repainted when something marked them dirty; the editor
+   can additionally repaint a range of buffer lines without a full werase. */
+enum {
+    DIRTY_MENU    = 1 << 0,
+    DIRTY_TABS    = 1 << 1,
+    DIRTY_SIDEBAR = 1 << 2,
+    DIRTY_EDITOR  = 1 << 3,
+    DIRTY_STATUS  = 1 << 4,
+    DIRTY_ALL     = DIRTY_MENU | DIRTY_TABS | DIRTY_SIDEBAR | DIRTY_EDITOR | DIRTY_STATUS,
+    DIRTY_CURSOR  = 1 << 5  /* only the soft cursor cell blinked */
+};
+
+static unsigned ui_dirty = DIRTY_ALL;
+static int ui_dirty_line_lo = INT_MAX; /* buffer lines to repaint, inclusive */
+static int ui_dirty_line_hi = -1;
+static int ui_scroll_rows = 0;  /* editor view moved by this many rows, nothing else */
+static int tty_lr_margins = 0;  /* terminal answered DECRQM for DECLRMM (mode 69) */
+static int tty_lrmm_was_set = 0; /* ... and had the mode set, so it is left set */
+
+static void ui_mark(unsigned what) {
+    ui_dirty |= what;
+}
+
+static void ui_mark_lines(int lo, int hi) {
+    if (lo < 0) lo = 0;
+    if (hi < lo) return;
+    if (lo < ui_dirty_line_lo) ui_dirty_line_lo = lo;
+    if (hi > ui_dirty_line_hi) ui_dirty_line_hi = hi;
+}
+
+/* ---------- STATS (latency instrumentation) ---------- */
+/* Rolling timings for each stage a keystroke goes through, from getch() to
+   the terminal flush. Syntax and LSP work done while a key is handled is
+   summed into one sample for that key. F12 shows p50/p99 over the last
+   STAT_SAMPLES samples; --stats=FILE writes them out on exit. */
+enum { STAT_KEY, STAT_SYNTAX, STAT_LSP, STAT_DRAW, STAT_FLUSH, STAT_LATENCY, STAT_TTY_BYTES, STAT_COUNT };
+static const char *stat_names[STAT_COUNT] = {
+    "key", "syntax", "lsp send", "draw", "refresh", "key->screen", "tty bytes"
+};
+
+#define STAT_SAMPLES 512
+
+typedef struct {
+    long long samples[STAT_SAMPLES];  /* microseconds */
+    int next;
+    int count;
+    unsigned long total;
+    long long max;
+} StatRing;
+
+static StatRing stats[STAT_COUNT];
+static long long stat_pending[STAT_COUNT];
+static int stat_pending_n[STAT_COUNT];
+static int stat_in_key = 0;
+static int stats_overlay = 0;
+static char stats_dump_path[PATH_MAX] = "";
+
+static long long stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000L;
+}
+
+static void stats_record(int stage, long long us) {
+    StatRing *r = &stats[stage];
+    r->samples[r->next] = us;
+    r->next = (r->next + 1) % STAT_SAMPLES;
+    if (r->count < STAT_SAMPLES) r->count++;
+    r->total++;
+    if (us > r->max) r->max = us;
+}
+
+/* Close a timed section started at start_us. */
+static void stats_add(int stage, long long start_us) {
+    long long us = stats_now_us() - start_us;
+    if (!stat_in_key) {
+        stats_record(stage, us);
+        return;
+    }
+    stat_pending[stage] += us;
+    stat_pending_n[stage]++;
+}
+
+static void stats_key_begin(void) {
+    memset(stat_pending, 0, sizeof(stat_pending));
+    memset(stat_pending_n, 0, sizeof(stat_pending_n));
+    stat_in_key = 1;
+}
+
+static void stats_key_end(long long start_us) {
+    stat_in_key = 0;
+    stats_record(STAT_KEY, stats_now_us() - start_us);
+    for (int i = 0; i < STAT_COUNT; i++)
+        if (stat_pending_n[i]) stats_record(i, stat_pending[i]);
+}
+
+static int stats_cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* p50/p99 over the samples currently in the ring; returns the sample count. */
+static int stats_percentiles(int stage, long long *p50, long long *p99) {
+    const StatRing *r = &stats[stage];
+    long long sorted[STAT_SAMPLES];
+    *p50 = *p99 = 0;
+    if (r->count == 0) return 0;
+    memcpy(sorted, r->samples, (size_t)r->count * sizeof(sorted[0]));
+    qsort(sorted, (size_t)r->count, sizeof(sorted[0]), stats_cmp_ll);
+    *p50 = sorted[(r->count - 1) / 2];
+    *p99 = sorted[(r->count - 1) * 99 / 100];
+    return r->count;
+}
+
+static void stats_dump(void) {
+    if (!stats_dump_path[0]) return;
+    FILE *fp = fopen(stats_dump_path, "w");
+    if (!fp) return;
+    fprintf(fp, "%-12s %10s %10s %10s %10s\n", "stage", "samples", "p50_ms", "p99_ms", "max_ms");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        long long p50, p99;
+        stats_percentiles(i, &p50, &p99);
+        if (i == STAT_TTY_BYTES) continue;
+        fprintf(fp, "%-12s %10lu %10.3f %10.3f %10.3f\n", stat_names[i], stats[i].total,
+                p50 / 1000.0, p99 / 1000.0, stats[i].max / 1000.0);
+    }
+    long long p50, p99;
+    stats_percentiles(STAT_TTY_BYTES, &p50, &p99);
+    fprintf(fp, "\n%-12s %10s %10s %10s %10s\n", "per frame", "frames", "p50", "p99", "max");
+    fprintf(fp, "%-12s %10lu %10lld %10lld %10lld\n", stat_names[STAT_TTY_BYTES],
+            stats[STAT_TTY_BYTES].total, p50, p99, stats[STAT_TTY_BYTES].max);
+    fclose(fp);
+}
+
+/* Bytes this process has written so far (wchar in /proc/self/io), or -1.
+   Sampled across render_frame() for the tty-bytes-per-frame figure; only
+   while the overlay is shown or --stats is set, as it costs a syscall. */
+static long long stats_wchar(void) {
+    static int fd = -2;
+    if (fd == -2) fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char io[512];
+    ssize_t n = pread(fd, io, sizeof(io) - 1, 0);
+    if (n <= 0) return -1;
+    io[n] = '\0';
+    const char *p = strstr(io, "wchar:");
+    return p ? atoll(p + 6) : -1;
+}
+
 /* ---------- STATE (PERSISTED) ---------- */
 static char session_restore_cwd[PATH_MAX] = "";
 static char session_restore_file[PATH_MAX] = "";
@@ -200,40 +380,116 @@ static void completion_clear(void) {
 }
 
 /* ---------- LSP ---------- */
+/* TextDocumentSyncKind from the server's initialize result. */
+enum { LSP_SYNC_NONE = 0, LSP_SYNC_FULL = 1, LSP_SYNC_INCREMENTAL = 2 };
+#define LSP_MAX_DELTAS 512
+#define LSP_CHANGE_DEBOUNCE_MS 50
+#define LSP_CHANGE_MAX_WAIT 4   /* a burst is held at most this many debounce periods */
+
+/* One contentChanges entry: the range is in the document as it stands after
+   the deltas queued before it, columns are bytes. */
+typedef struct {
+    int start_line, start_col;
+    int end_line, end_col;
+    char *text;
+    size_t len;
+} LspDelta;
+
+/* A document a server knows, with what it was last sent. Edits are
+   recorded against the active document; the others keep theirs until they
+   are active again. */
+typedef struct LspDoc {
+    struct LspDoc *next;
+    char *uri;
+    char language_id[16];
+    int open;             /* didOpen sent */
+    int version;          /* last version sent */
+    int change_full;      /* next didChange must carry the whole text */
+    LspDelta *deltas;     /* not sent yet */
+    int delta_count;
+    int delta_cap;
+    /* The last completion list, for the word starting at cache_line,
+       cache_col; labels not starting with cache_prefix were left out.
+       Dropped by any recorded change but typing into that word. */
+    char (*cache)[MAX_COMPLETION_LABEL];
+    int cache_count;
+    int cache_line, cache_col;
+    int cache_incomplete;
+    char cache_prefix[MAX_COMPLETION_LABEL];
+} LspDoc;
+
 typedef struct {
     int running;
     int initialized;
-    int needs_open;
-    int doc_version;
-    int init_id;
-    int pending_completion_id;
+    int sync_kind;
+    int utf8_positions;         /* the server agreed to byte columns */
+    LspDoc *docs;
+    LspDoc *doc;                /* the active document, or NULL */
+    long long change_due_ms;    /* 0 when nothing is scheduled */
+    long long change_first_ms;
+    int next_id;                /* request ids only ever grow */
+    int pending_completion_id;  /* -1 when none is outstanding */
+    LspDoc *completion_doc;     /* where the pending completion was asked */
+    int completion_version;
+    int completion_line, completion_col;
+    int completion_start;       /* column its word starts at */
     pid_t pid;
     int in_fd;
-    int out_fd;
+    struct LspIo *io;
+    struct LspBlock *wq_head, *wq_tail;   /* what the pipe has not taken yet */
+    size_t wq_bytes;
+    long long idle_since_ms;    /* when it stopped being the active server */
     char server_name[32];
-    char language_id[16];
-    char doc_uri[PATH_MAX * 2];
     char root_uri[PATH_MAX * 2];
-    char read_buf[16384];
-    size_t read_len;
 } LspClient;
 
-static LspClient lsp = {0};
+/* Servers outlive tab switches: one runs per (language, root) and keeps
+   its documents open, so coming back to a tab sends at most the changes
+   it has pending. lsp is the one the current tab uses, or lsp_none
+   when there is none; code that services every server points it at each
+   in turn. A server that has not been active for lsp_idle_timeout seconds
+   (state.ini, 0 keeps them) is shut down. */
+#define LSP_MAX_SERVERS 8
+#define LSP_IDLE_TIMEOUT_S 600
+
+static LspClient lsp_pool[LSP_MAX_SERVERS];
+static LspClient lsp_none;
+static LspClient *lsp = &lsp_none;
+static int lsp_idle_timeout = LSP_IDLE_TIMEOUT_S;
+/* Set by headless modes that must not start servers. */
+static int lsp_disabled = 0;
+/* Queued changes go out this long after the last edit (lsp_debounce_ms in
+   state.ini, 0 sends at once). Requests that read the document flush
+   them first. */
+static int lsp_debounce_ms = LSP_CHANGE_DEBOUNCE_MS;
 
 /* ---------- UTIL ---------- */
 int popup_select(const char *title, const char *items[], int count);
 void load_dir(void);
 static void syntax_recalc_all(void);
-static void lsp_prepare_for_file(const char *file, const SyntaxLang *lang);
+static void lsp_prepare_for_file(const char *file, const char *root, const SyntaxLang *lang);
+static void current_root_set(void);
+static void path_canonical(const char *path, char *out, size_t out_sz);
+static void lsp_close_document(const char *path);
+static void lsp_reload_document(const char *path);
 static void set_status(const char *fmt, ...);
 static void state_save(void);
 void load_file(const char *f);
 void save_file(void);
 void save_file_as(void);
 static void tab_switch(int idx);
+static long long now_ms(void);
+static void ui_wakeup(void);
 static int tab_create_with_file(const char *path);
 static void tab_restore(int idx);
 static void get_mem_usage_cached(long *rss_kb_out, long *vsz_kb_out);
+static void edit_changed(int start_line, int min_lines);
+static void edit_batch_flush(void);
+static void wrap_invalidate(void);
+static void wrap_lines_changed(int lo, int hi);
+static void wrap_lines_moved(int lo, int hi, int delta);
+static void preview_selection_changed(void);
+static void preview_pane_resized(void);
 
 static int num_digits(int n) {
     int d = 1;
@@ -300,9 +556,11 @@ static void buffer_init_if_needed(void) {
 
 static void tab_store_current(void) {
     if (tab_current < 0 || tab_current >= tab_count) return;
+    edit_batch_flush();
     Tab *t = &tabs[tab_current];
     strncpy(t->path, current_file, sizeof(t->path) - 1);
     t->path[sizeof(t->path) - 1] = '\0';
+    memcpy(t->root, current_root, sizeof(t->root));
     t->buf = buf;
     t->buf_cap = buf_cap;
     t->lines = lines;
@@ -358,6 +616,7 @@ static int tab_close(int idx) {
         }
     }
 
+    lsp_close_document(tabs[idx].path);
     tab_free_buffers(&tabs[idx]);
     for (int i = idx; i < tab_count - 1; i++) {
         tabs[i] = tabs[i + 1];
@@ -406,17 +665,21 @@ static void tab_restore(int idx) {
     cx = t->cx;
     cy = t->cy;
     rowoff = t->rowoff;
+    rowoff_sub = 0;
     coloff = t->coloff;
     is_dirty = t->is_dirty;
     hl_open_comment = t->hl_open_comment;
     hl_open_comment_cap = t->hl_open_comment_cap;
     strncpy(current_file, t->path, sizeof(current_file) - 1);
     current_file[sizeof(current_file) - 1] = '\0';
+    memcpy(current_root, t->root, sizeof(current_root));
     if (!buf) buffer_init_if_needed();
     const SyntaxLang *lang = sh_lang_for_file(current_file);
-    lsp_prepare_for_file(current_file, lang);
+    lsp_prepare_for_file(current_file, current_root, lang);
+    wrap_invalidate();
     syntax_recalc_all();
     state_save();
+    ui_mark(DIRTY_ALL);
 }
 
 static void tabs_init_from_current(void) {
@@ -460,9 +723,11 @@ static int tab_create_with_file(const char *path) {
         cx = cy = rowoff = coloff = 0;
         is_dirty = 0;
         current_file[0] = '\0';
+        current_root_set();
         if (hl_open_comment) memset(hl_open_comment, 0, (size_t)hl_open_comment_cap);
         const SyntaxLang *lang = sh_lang_for_file(current_file);
-        lsp_prepare_for_file(current_file, lang);
+        lsp_prepare_for_file(current_file, current_root, lang);
+        wrap_invalidate();
         syntax_recalc_all();
         state_save();
     }
@@ -496,7 +761,9 @@ static void tab_prev(void) {
     tab_switch(prev);
 }
 
-static void tab_open_file(const char *path) {
+static void tab_open_file(const char *name) {
+    char path[PATH_MAX];
+    path_canonical(name, path, sizeof(path));
     int idx = tab_find_by_path(path);
     if (idx >= 0) {
         tab_switch(idx);
@@ -511,6 +778,7 @@ static void set_status(const char *fmt, ...) {
     vsnprintf(status_msg, sizeof(status_msg), fmt, ap);
     va_end(ap);
     status_time = time(NULL);
+    ui_mark(DIRTY_STATUS);
 }
 
 static void disable_flow_control(void) {
@@ -633,13 +901,17 @@ static unsigned char syntax_calc_line_end_open_comment(const SyntaxLang *lang,
 }
 
 static void syntax_recalc_all(void) {
+    TRACE_SCOPE("syntax_recalc_all");
     const SyntaxLang *lang = sh_lang_for_file(current_file);
     if (!hl_open_comment || !buf) return;
+    long long t0 = stats_now_us();
     unsigned char in_comment = 0;
     for (int i = 0; i < lines; i++) {
         in_comment = syntax_calc_line_end_open_comment(lang, buf[i], in_comment);
         hl_open_comment[i] = in_comment;
     }
+    ui_mark(DIRTY_EDITOR);
+    stats_add(STAT_SYNTAX, t0);
 }
 
 static void syntax_recalc_from(int start_line, int min_lines) {
@@ -648,15 +920,140 @@ static void syntax_recalc_from(int start_line, int min_lines) {
     if (start_line < 0) start_line = 0;
     if (start_line >= lines) return;
     if (min_lines < 1) min_lines = 1;
+    long long t0 = stats_now_us();
     unsigned char in_comment = (start_line > 0) ? hl_open_comment[start_line - 1] : 0;
     int updated = 0;
-    for (int i = start_line; i < lines; i++) {
+    int i = start_line;
+    for (; i < lines; i++) {
         unsigned char old = hl_open_comment[i];
         in_comment = syntax_calc_line_end_open_comment(lang, buf[i], in_comment);
         hl_open_comment[i] = in_comment;
         updated++;
         if (updated >= min_lines && hl_open_comment[i] == old) break;
     }
+    /* The line after the last one touched starts in the state we just wrote. */
+    ui_mark_lines(start_line, i + 1);
+    wrap_lines_changed(start_line, i);
+    stats_add(STAT_SYNTAX, t0);
+}
+
+/* Attributes used by the highlighter. */
+#define HL_NORMAL   ((chtype)A_NORMAL)
+#define HL_KEYWORD  ((chtype)(COLOR_PAIR(4) | A_BOLD))
+#define HL_COMMENT  ((chtype)(COLOR_PAIR(6) | A_DIM))
+#define HL_STRING   ((chtype)COLOR_PAIR(7))
+#define HL_NUMBER   ((chtype)COLOR_PAIR(8))
+#define HL_PREPROC  ((chtype)(COLOR_PAIR(9) | A_BOLD))
+
+/* Highlight one line into a per-character attribute array (at most `max`
+   entries; pass at least the line length for an exact end state).
+   `in_block_comment` carries the block comment state in and out. Returns the
+   number of attributes written. Pure: safe off the UI thread. */
+static int syntax_line_attrs(const SyntaxLang *lang, const char *line, int *in_block_comment,
+                             chtype *attrs, int max) {
+    const char *lc = (lang && lang->line_comment && lang->line_comment[0]) ? lang->line_comment : NULL;
+    const char *bcs = (lang && lang->block_comment_start && lang->block_comment_start[0]) ? lang->block_comment_start : NULL;
+    const char *bce = (lang && lang->block_comment_end && lang->block_comment_end[0]) ? lang->block_comment_end : NULL;
+    int lc_len = lc ? (int)strlen(lc) : 0;
+    int bcs_len = bcs ? (int)strlen(bcs) : 0;
+    int bce_len = bce ? (int)strlen(bce) : 0;
+    int in_block = (in_block_comment && bcs_len && bce_len) ? *in_block_comment : 0;
+    char in_string = 0;
+
+    int preproc_start = -1;
+    if (lang_is_c_preproc(lang)) {
+        int j = 0;
+        while (line[j] == ' ' || line[j] == '\t') j++;
+        if (line[j] == '#') preproc_start = j;
+    }
+
+    int i = 0;
+    while (line[i] && i < max) {
+        if (!in_block && !in_string && preproc_start >= 0 && i >= preproc_start) {
+            while (line[i] && i < max) attrs[i++] = HL_PREPROC;
+            break;
+        }
+        if (line[i] == '\t') {
+            attrs[i++] = HL_NORMAL;
+            continue;
+        }
+        if (in_block) {
+            if (bce_len && strncmp(&line[i], bce, (size_t)bce_len) == 0) {
+                for (int k = 0; k < bce_len && i < max; k++) attrs[i++] = HL_COMMENT;
+                in_block = 0;
+                continue;
+            }
+            attrs[i++] = HL_COMMENT;
+            continue;
+        }
+        if (in_string) {
+            if (line[i] == '\\' && line[i + 1]) {
+                attrs[i++] = HL_STRING;
+                if (i < max) attrs[i++] = HL_STRING;
+                continue;
+            }
+            if (line[i] == in_string) in_string = 0;
+            attrs[i++] = HL_STRING;
+            continue;
+        }
+        if (lc_len && strncmp(&line[i], lc, (size_t)lc_len) == 0) {
+            while (line[i] && i < max) attrs[i++] = HL_COMMENT;
+            break;
+        }
+        if (bcs_len && strncmp(&line[i], bcs, (size_t)bcs_len) == 0) {
+            for (int k = 0; k < bcs_len && i < max; k++) attrs[i++] = HL_COMMENT;
+            in_block = 1;
+            continue;
+        }
+        if (lang_has_string_delim(lang, line[i])) {
+            in_string = line[i];
+            attrs[i++] = HL_STRING;
+            continue;
+        }
+        if (isdigit((unsigned char)line[i]) ||
+            (line[i] == '.' && isdigit((unsigned char)line[i + 1]))) {
+            while (line[i] && i < max &&
+                   (isalnum((unsigned char)line[i]) || line[i] == '.' || line[i] == '_' ||
+                    line[i] == '+' || line[i] == '-')) {
+                attrs[i++] = HL_NUMBER;
+            }
+            continue;
+        }
+        if (isalpha((unsigned char)line[i]) || line[i] == '_') {
+            int wstart = i;
+            while (line[i] && (isalnum((unsigned char)line[i]) || line[i] == '_')) i++;
+            chtype a = (lang && sh_is_keyword(lang, &line[wstart], i - wstart)) ? HL_KEYWORD : HL_NORMAL;
+            if (i > max) i = max;
+            for (int k = wstart; k < i; k++) attrs[k] = a;
+            continue;
+        }
+        attrs[i++] = HL_NORMAL;
+    }
+    if (in_block_comment) *in_block_comment = in_block;
+    return i;
+}
+
+/* ncurses calls issued by the row renderers, for --bench-render. */
+static long render_curses_calls = 0;
+
+/* Draw `n` characters of `text` starting at (y, x), one waddnstr per run of
+   identical attributes. Tabs are shown as a single space. */
+static void draw_attr_runs(WINDOW *win, int y, int x, const char *text, const chtype *attrs, int n) {
+    char run[MAX_LINE];
+    int i = 0;
+    while (i < n) {
+        int j = i;
+        while (j < n && attrs[j] == attrs[i]) {
+            run[j - i] = (text[j] == '\t') ? ' ' : text[j];
+            j++;
+        }
+        wattrset(win, attrs[i]);
+        mvwaddnstr(win, y, x + i, run, j - i);
+        render_curses_calls += 2;
+        i = j;
+    }
+    wattrset(win, A_NORMAL);
+    render_curses_calls++;
 }
 
 static void uri_encode(const char *in, char *out, size_t out_sz) {
@@ -676,6 +1073,27 @@ static void uri_encode(const char *in, char *out, size_t out_sz) {
     out[o] = '\0';
 }
 
+/* The absolute path of a file, which need not exist yet: realpath() of the
+   file, else of its directory plus the name. Tabs and LSP documents are
+   keyed by this, so they stay the same file whatever the explorer's
+   current directory is later. */
+static void path_canonical(const char *path, char *out, size_t out_sz) {
+    char abs[PATH_MAX];
+    if (realpath(path, abs)) {
+        snprintf(out, out_sz, "%s", abs);
+        return;
+    }
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else if (slash == path) snprintf(dir, sizeof(dir), "/");
+    else snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    const char *name = slash ? slash + 1 : path;
+    if (!realpath(dir, abs) ||
+        snprintf(out, out_sz, "%s%s%s", abs, strcmp(abs, "/") == 0 ? "" : "/", name) >= (int)out_sz)
+        snprintf(out, out_sz, "%s", path);
+}
+
 static void make_file_uri(const char *path, char *out, size_t out_sz) {
     char abs[PATH_MAX];
     if (path[0] == '/') {
@@ -691,59 +1109,6 @@ static void make_file_uri(const char *path, char *out, size_t out_sz) {
     snprintf(out, out_sz, "file://%s", enc);
 }
 
-static char *buffer_to_text(size_t *out_len) {
-    size_t total = 0;
-    for (int i = 0; i < lines; i++) {
-        total += strlen(buf[i]);
-        if (i < lines - 1) total += 1;
-    }
-    char *text = (char *)malloc(total + 1);
-    if (!text) return NULL;
-    size_t pos = 0;
-    for (int i = 0; i < lines; i++) {
-        size_t len = strlen(buf[i]);
-        memcpy(text + pos, buf[i], len);
-        pos += len;
-        if (i < lines - 1) text[pos++] = '\n';
-    }
-    text[pos] = '\0';
-    if (out_len) *out_len = pos;
-    return text;
-}
-
-static char *json_escape_text(const char *in) {
-    size_t len = strlen(in);
-    size_t cap = len * 2 + 8;
-    char *out = (char *)malloc(cap);
-    if (!out) return NULL;
-    size_t o = 0;
-    for (size_t i = 0; i < len; i++) {
-        char c = in[i];
-        if (c == '\\' || c == '\"') {
-            if (o + 2 >= cap) break;
-            out[o++] = '\\';
-            out[o++] = c;
-        } else if (c == '\n') {
-            if (o + 2 >= cap) break;
-            out[o++] = '\\';
-            out[o++] = 'n';
-        } else if (c == '\r') {
-            if (o + 2 >= cap) break;
-            out[o++] = '\\';
-            out[o++] = 'r';
-        } else if (c == '\t') {
-            if (o + 2 >= cap) break;
-            out[o++] = '\\';
-            out[o++] = 't';
-        } else {
-            if (o + 1 >= cap) break;
-            out[o++] = c;
-        }
-    }
-    out[o] = '\0';
-    return out;
-}
-
 static void str_rstrip(char *s) {
     size_t n = s ? strlen(s) : 0;
     while (n > 0) {
@@ -804,7 +1169,12 @@ static int get_state_paths(char *dir_out, size_t dir_out_sz, char *file_out, siz
     return 1;
 }
 
+/* Set by headless modes that must not touch the user's session file. */
+static int state_readonly = 0;
+
 static void state_save(void) {
+    TRACE_SCOPE("state_save");
+    if (state_readonly) return;
     char dir[PATH_MAX];
     char path[PATH_MAX];
     if (!get_state_paths(dir, sizeof(dir), path, sizeof(path))) return;
@@ -821,7 +1191,10 @@ static void state_save(void) {
     fprintf(fp, "show_line_numbers=%d\n", show_line_numbers ? 1 : 0);
     fprintf(fp, "show_status_bar=%d\n", show_status_bar ? 1 : 0);
     fprintf(fp, "soft_wrap=%d\n", soft_wrap ? 1 : 0);
+    if (cursor_blink_chosen) fprintf(fp, "cursor_blink=%d\n", cursor_blink);
     fprintf(fp, "sidebar_right=%d\n", sidebar_on_right ? 1 : 0);
+    fprintf(fp, "lsp_debounce_ms=%d\n", lsp_debounce_ms);
+    fprintf(fp, "lsp_idle_timeout=%d\n", lsp_idle_timeout);
     fprintf(fp, "cwd=%s\n", cwd_now);
     fprintf(fp, "file=%s\n", current_file);
     fprintf(fp, "cx=%d\n", cx);
@@ -857,7 +1230,22 @@ static void state_load(void) {
         if (strcmp(key, "show_line_numbers") == 0) show_line_numbers = atoi(val) ? 1 : 0;
         else if (strcmp(key, "show_status_bar") == 0) show_status_bar = atoi(val) ? 1 : 0;
         else if (strcmp(key, "soft_wrap") == 0) soft_wrap = atoi(val) ? 1 : 0;
+        else if (strcmp(key, "cursor_blink") == 0) {
+            int v = atoi(val);
+            if (v >= CURSOR_BLINK_OFF && v <= CURSOR_BLINK_TERMINAL) {
+                cursor_blink = v;
+                cursor_blink_chosen = 1;
+            }
+        }
         else if (strcmp(key, "sidebar_right") == 0) sidebar_on_right = atoi(val) ? 1 : 0;
+        else if (strcmp(key, "lsp_debounce_ms") == 0) {
+            int v = atoi(val);
+            if (v >= 0 && v <= 2000) lsp_debounce_ms = v;
+        }
+        else if (strcmp(key, "lsp_idle_timeout") == 0) {
+            int v = atoi(val);
+            if (v >= 0 && v <= 86400) lsp_idle_timeout = v;
+        }
         else if (strcmp(key, "cwd") == 0) {
             if (val[0]) {
                 strncpy(session_restore_cwd, val, sizeof(session_restore_cwd) - 1);
@@ -906,312 +1294,1667 @@ static const char *lsp_cmd_for_lang(const char *name) {
     return NULL;
 }
 
-static int lsp_send_raw(const char *json, size_t len) {
-    if (!lsp.running) return 0;
-    char header[64];
-    int hlen = snprintf(header, sizeof(header), "Content-Length: %zu\r\n\r\n", len);
-    if (write(lsp.in_fd, header, (size_t)hlen) < 0) return 0;
-    if (write(lsp.in_fd, json, len) < 0) return 0;
-    return 1;
+/* The server's stdin is nonblocking. Whatever a write cannot take right
+   away is queued, one block per message, and drained from lsp_poll() once
+   poll() reports the pipe writable. While anything is queued, debounced
+   didChanges are held back so their deltas keep coalescing, and a
+   full-text didChange drops the queued, unstarted syncs of the same
+   document that it supersedes. */
+enum { LSP_MSG_OTHER, LSP_MSG_SYNC, LSP_MSG_SYNC_FULL };
+#define LSP_WQ_HIGH (256 * 1024)   /* above this, skip completion requests */
+
+typedef struct LspBlock {
+    struct LspBlock *next;
+    int kind;
+    int started;          /* some of the message has reached the server */
+    char *uri;            /* document of a sync message */
+    char *data;
+    size_t len, cap, off;
+} LspBlock;
+
+static void lsp_block_free(LspBlock *b) {
+    free(b->uri);
+    free(b->data);
+    free(b);
 }
 
-static int lsp_send_fmt(const char *fmt, ...) {
-    char buf[8192];
-    va_list ap;
-    va_start(ap, fmt);
-    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
-    if (len <= 0) return 0;
-    if ((size_t)len >= sizeof(buf)) len = (int)sizeof(buf) - 1;
-    return lsp_send_raw(buf, (size_t)len);
+static void lsp_wq_clear(void) {
+    while (lsp->wq_head) {
+        LspBlock *b = lsp->wq_head;
+        lsp->wq_head = b->next;
+        lsp_block_free(b);
+    }
+    lsp->wq_tail = NULL;
+    lsp->wq_bytes = 0;
 }
 
-static void lsp_shutdown(void) {
-    if (!lsp.running) return;
-    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"shutdown\"}", lsp.init_id + 1000);
-    const char *exit_msg = "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}";
-    lsp_send_raw(exit_msg, strlen(exit_msg));
-    close(lsp.in_fd);
-    close(lsp.out_fd);
-    if (lsp.pid > 0) {
-        kill(lsp.pid, SIGTERM);
-        waitpid(lsp.pid, NULL, 0);
+/* Drop queued syncs of uri that have not started; a full text follows. */
+static void lsp_wq_drop_syncs(const char *uri) {
+    LspBlock **pp = &lsp->wq_head;
+    lsp->wq_tail = NULL;
+    while (*pp) {
+        LspBlock *b = *pp;
+        if (b->kind != LSP_MSG_OTHER && !b->started && b->uri && strcmp(b->uri, uri) == 0) {
+            *pp = b->next;
+            lsp->wq_bytes -= b->len;
+            lsp_block_free(b);
+            continue;
+        }
+        lsp->wq_tail = b;
+        pp = &b->next;
     }
-    memset(&lsp, 0, sizeof(lsp));
-    completion_clear();
 }
 
-static int lsp_spawn(const char *cmd, const char *server_name) {
-    int inpipe[2];
-    int outpipe[2];
-    if (pipe(inpipe) != 0) return 0;
-    if (pipe(outpipe) != 0) {
-        close(inpipe[0]); close(inpipe[1]);
-        return 0;
-    }
+static LspBlock *lsp_wq_push(int kind, const char *uri, int started) {
+    if (kind == LSP_MSG_SYNC_FULL && uri) lsp_wq_drop_syncs(uri);
+    LspBlock *b = (LspBlock *)calloc(1, sizeof(LspBlock));
+    if (!b) return NULL;
+    b->kind = kind;
+    b->started = started;
+    if (uri) b->uri = strdup(uri);
+    if (lsp->wq_tail) lsp->wq_tail->next = b;
+    else lsp->wq_head = b;
+    lsp->wq_tail = b;
+    return b;
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        close(inpipe[0]); close(inpipe[1]);
-        close(outpipe[0]); close(outpipe[1]);
-        return 0;
+static int lsp_block_append(LspBlock *b, const void *s, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (b->len + n > cap) cap *= 2;
+        char *p = (char *)realloc(b->data, cap);
+        if (!p) return 0;
+        b->data = p;
+        b->cap = cap;
     }
-    if (pid == 0) {
-        dup2(inpipe[0], STDIN_FILENO);
-        dup2(outpipe[1], STDOUT_FILENO);
-        close(inpipe[1]);
-        close(outpipe[0]);
-        const int max_args = 8;
-        char *argv[max_args + 1];
-        char cmd_copy[256];
-        strncpy(cmd_copy, cmd, sizeof(cmd_copy) - 1);
-        cmd_copy[sizeof(cmd_copy) - 1] = '\0';
-        int argc = 0;
-        char *tok = strtok(cmd_copy, " ");
-        while (tok && argc < max_args) {
-            argv[argc++] = tok;
-            tok = strtok(NULL, " ");
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    lsp->wq_bytes += n;
+    return 1;
+}
+
+/* Write as much of the queue as the pipe takes. Returns 0 on a write
+   error other than a full pipe. */
+static int lsp_wq_drain(void) {
+    while (lsp->wq_head) {
+        LspBlock *b = lsp->wq_head;
+        if (b->off < b->len) {
+            ssize_t wr = write(lsp->in_fd, b->data + b->off, b->len - b->off);
+            if (wr < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            b->off += (size_t)wr;
+            b->started = 1;
+            if (b->off < b->len) return 1;
         }
-        argv[argc] = NULL;
-        execvp(argv[0], argv);
-        _exit(1);
+        lsp->wq_head = b->next;
+        if (!lsp->wq_head) lsp->wq_tail = NULL;
+        lsp->wq_bytes -= b->len;
+        lsp_block_free(b);
     }
-
-    close(inpipe[0]);
-    close(outpipe[1]);
-    int flags = fcntl(outpipe[0], F_GETFL, 0);
-    fcntl(outpipe[0], F_SETFL, flags | O_NONBLOCK);
-
-    memset(&lsp, 0, sizeof(lsp));
-    lsp.running = 1;
-    lsp.initialized = 0;
-    lsp.needs_open = 0;
-    lsp.doc_version = 0;
-    lsp.pid = pid;
-    lsp.in_fd = inpipe[1];
-    lsp.out_fd = outpipe[0];
-    lsp.read_len = 0;
-    lsp.pending_completion_id = -1;
-    lsp.init_id = 1;
-    strncpy(lsp.server_name, server_name ? server_name : "lsp", sizeof(lsp.server_name) - 1);
     return 1;
 }
 
-static void lsp_send_initialize(void) {
-    int pid = (int)getpid();
-    lsp.init_id = 1;
-    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"initialize\",\"params\":{\"processId\":%d,\"rootUri\":\"%s\",\"capabilities\":{\"textDocument\":{\"completion\":{\"completionItem\":{\"snippetSupport\":false}}}}}}",
-                 lsp.init_id, pid, lsp.root_uri);
-}
+/* Outgoing messages are streamed. A body builder runs twice: once only
+   measuring, for Content-Length, and once writing. Short pieces are copied
+   into a reusable chunk; long runs that need no escaping, such as most
+   buffer lines, go into the writev chain straight from where they live.
+   No message is ever assembled whole. */
+#define LSP_W_IOV 64
+#define LSP_W_CHUNK 16384
+#define LSP_W_DIRECT 128   /* clean runs this long are referenced, not copied */
 
-static void lsp_send_initialized(void) {
-    const char *msg = "{\"jsonrpc\":\"2.0\",\"method\":\"initialized\",\"params\":{}}";
-    lsp_send_raw(msg, strlen(msg));
+typedef struct {
+    int measure;
+    size_t total;
+    int failed;
+    int kind;
+    const char *uri;
+    int wrote;            /* part of this message went straight to the pipe */
+    LspBlock *queued;     /* where the rest of this message is queued */
+    struct iovec iov[LSP_W_IOV];
+    int niov;
+    char chunk[LSP_W_CHUNK];
+    size_t used;
+} LspWriter;
+
+static LspWriter lsp_w;
+
+typedef void (*LspBodyFn)(LspWriter *w);
+
+static void lsp_w_reset(LspWriter *w, int measure, int kind, const char *uri) {
+    w->measure = measure;
+    w->total = 0;
+    w->failed = 0;
+    w->kind = kind;
+    w->uri = uri;
+    w->wrote = 0;
+    w->queued = NULL;
+    w->niov = 0;
+    w->used = 0;
 }
 
-static void lsp_send_did_open(void) {
-    char *text = buffer_to_text(NULL);
-    if (!text) return;
-    char *esc = json_escape_text(text);
-    free(text);
-    if (!esc) return;
-    lsp.doc_version = 1;
-    size_t cap = strlen(esc) + strlen(lsp.doc_uri) + strlen(lsp.language_id) + 256;
-    char *json = (char *)malloc(cap);
-    if (json) {
-        int len = snprintf(json, cap,
-                           "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":{\"uri\":\"%s\",\"languageId\":\"%s\",\"version\":%d,\"text\":\"%s\"}}}",
-                           lsp.doc_uri, lsp.language_id, lsp.doc_version, esc);
-        if (len > 0) lsp_send_raw(json, (size_t)len);
-        free(json);
+/* Hand the chain to the pipe; whatever it does not take, and everything
+   once the queue is in use, is copied to this message's queue block. */
+static void lsp_w_flush(LspWriter *w) {
+    struct iovec *iov = w->iov;
+    int n = w->niov;
+    while (n > 0 && !w->failed && !w->queued && !lsp->wq_head) {
+        ssize_t wr = writev(lsp->in_fd, iov, n);
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) w->failed = 1;
+            break;
+        }
+        if (wr > 0) w->wrote = 1;
+        size_t left = (size_t)wr;
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
     }
-    free(esc);
-}
-
-static void lsp_send_did_change(void) {
-    if (!lsp.initialized) return;
-    char *text = buffer_to_text(NULL);
-    if (!text) return;
-    char *esc = json_escape_text(text);
-    free(text);
-    if (!esc) return;
-    lsp.doc_version++;
-    size_t cap = strlen(esc) + strlen(lsp.doc_uri) + 256;
-    char *json = (char *)malloc(cap);
-    if (json) {
-        int len = snprintf(json, cap,
-                           "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":\"%s\",\"version\":%d},\"contentChanges\":[{\"text\":\"%s\"}]}}",
-                           lsp.doc_uri, lsp.doc_version, esc);
-        if (len > 0) lsp_send_raw(json, (size_t)len);
-        free(json);
-    }
-    free(esc);
-}
-
-static int json_extract_id(const char *json) {
-    const char *p = strstr(json, "\"id\"");
-    if (!p) return -1;
-    p = strchr(p, ':');
-    if (!p) return -1;
-    p++;
-    while (*p && isspace((unsigned char)*p)) p++;
-    if (!isdigit((unsigned char)*p) && *p != '-') return -1;
-    return atoi(p);
-}
-
-static const char *json_parse_string(const char *p, char *out, size_t out_sz) {
-    if (!p || *p != '"') return NULL;
-    p++;
-    size_t o = 0;
-    while (*p && *p != '"') {
-        char c = *p++;
-        if (c == '\\' && *p) {
-            char e = *p++;
-            if (e == 'n') c = '\n';
-            else if (e == 't') c = '\t';
-            else c = e;
+    if (n > 0 && !w->failed) {
+        if (!w->queued) w->queued = lsp_wq_push(w->kind, w->uri, w->wrote);
+        for (int i = 0; i < n && w->queued; i++) {
+            if (!lsp_block_append(w->queued, iov[i].iov_base, iov[i].iov_len)) w->failed = 1;
         }
-        if (o + 1 < out_sz) out[o++] = c;
+        if (!w->queued) w->failed = 1;
     }
-    out[o] = '\0';
-    return (*p == '"') ? (p + 1) : NULL;
+    w->niov = 0;
+    w->used = 0;
 }
 
-static void lsp_parse_completions(const char *json, const char *prefix) {
-    completion_clear();
-    completion_from_lsp = 1;
-    size_t prefix_len = prefix ? strlen(prefix) : 0;
-    const char *p = json;
-    while ((p = strstr(p, "\"label\"")) != NULL) {
-        p = strchr(p, ':');
-        if (!p) break;
-        p++;
-        while (*p && isspace((unsigned char)*p)) p++;
-        char label[MAX_COMPLETION_LABEL];
-        const char *next = json_parse_string(p, label, sizeof(label));
-        if (!next) { p++; continue; }
-        if (prefix_len == 0 || strncmp(label, prefix, prefix_len) == 0) {
-            if (completion_count < MAX_COMPLETIONS) {
-                strncpy(completion_items[completion_count], label, MAX_COMPLETION_LABEL - 1);
-                completion_items[completion_count][MAX_COMPLETION_LABEL - 1] = '\0';
-                completion_count++;
-            }
+static void lsp_w_copy(LspWriter *w, const char *s, size_t n) {
+    if (w->measure) { w->total += n; return; }
+    while (n > 0) {
+        if (w->used == LSP_W_CHUNK) lsp_w_flush(w);
+        struct iovec *last = w->niov ? &w->iov[w->niov - 1] : NULL;
+        int extends = last && (char *)last->iov_base + last->iov_len == w->chunk + w->used;
+        if (!extends && w->niov == LSP_W_IOV) {
+            lsp_w_flush(w);
+            extends = 0;
+        }
+        size_t take = LSP_W_CHUNK - w->used;
+        if (take > n) take = n;
+        memcpy(w->chunk + w->used, s, take);
+        if (extends) {
+            w->iov[w->niov - 1].iov_len += take;
+        } else {
+            w->iov[w->niov].iov_base = w->chunk + w->used;
+            w->iov[w->niov].iov_len = take;
+            w->niov++;
         }
-        p = next;
+        w->used += take;
+        s += take;
+        n -= take;
     }
-    if (completion_count > 0) completion_active = 1;
 }
 
-static void lsp_poll(void) {
-    if (!lsp.running) return;
-    char tmp[4096];
-    ssize_t n = read(lsp.out_fd, tmp, sizeof(tmp));
-    if (n == 0) {
-        lsp_shutdown();
-        return;
-    }
+/* s must stay put until the message is flushed. */
+static void lsp_w_ref(LspWriter *w, const char *s, size_t n) {
+    if (n < LSP_W_DIRECT) { lsp_w_copy(w, s, n); return; }
+    if (w->measure) { w->total += n; return; }
+    if (w->niov == LSP_W_IOV) lsp_w_flush(w);
+    w->iov[w->niov].iov_base = (void *)s;
+    w->iov[w->niov].iov_len = n;
+    w->niov++;
+}
+
+static void lsp_w_str(LspWriter *w, const char *s) {
+    lsp_w_copy(w, s, strlen(s));
+}
+
+static void lsp_w_printf(LspWriter *w, const char *fmt, ...) {
+    char tmp[512];
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
     if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
-        lsp_shutdown();
-        return;
+        w->failed = 1;
+    } else if ((size_t)n < sizeof(tmp)) {
+        lsp_w_copy(w, tmp, (size_t)n);
+    } else {
+        char *big = (char *)malloc((size_t)n + 1);
+        if (big) {
+            vsnprintf(big, (size_t)n + 1, fmt, ap2);
+            lsp_w_copy(w, big, (size_t)n);
+            free(big);
+        } else {
+            w->failed = 1;
+        }
     }
-    if (lsp.read_len + (size_t)n >= sizeof(lsp.read_buf)) lsp.read_len = 0;
-    memcpy(lsp.read_buf + lsp.read_len, tmp, (size_t)n);
-    lsp.read_len += (size_t)n;
+    va_end(ap2);
+}
 
-    while (1) {
-        char *header_end = NULL;
-        for (size_t i = 0; i + 3 < lsp.read_len; i++) {
-            if (lsp.read_buf[i] == '\r' && lsp.read_buf[i+1] == '\n' &&
-                lsp.read_buf[i+2] == '\r' && lsp.read_buf[i+3] == '\n') {
-                header_end = lsp.read_buf + i + 4;
-                break;
-            }
-        }
-        if (!header_end) break;
-        int content_length = 0;
-        char header[128];
-        size_t header_size = (size_t)(header_end - lsp.read_buf);
-        size_t copy_len = header_size < sizeof(header) - 1 ? header_size : sizeof(header) - 1;
-        memcpy(header, lsp.read_buf, copy_len);
-        header[copy_len] = '\0';
-        if (sscanf(header, "Content-Length: %d", &content_length) != 1) {
-            lsp.read_len = 0;
-            break;
-        }
-        size_t header_len = (size_t)(header_end - lsp.read_buf);
-        if (lsp.read_len < header_len + (size_t)content_length) break;
-        char *json = (char *)malloc((size_t)content_length + 1);
-        if (!json) return;
-        memcpy(json, lsp.read_buf + header_len, (size_t)content_length);
-        json[content_length] = '\0';
-
-        int id = json_extract_id(json);
-        if (id == lsp.init_id && !lsp.initialized) {
-            lsp.initialized = 1;
-            lsp_send_initialized();
-            if (lsp.needs_open) {
-                lsp_send_did_open();
-                lsp.needs_open = 0;
-            }
-        } else if (id == lsp.pending_completion_id && lsp.pending_completion_id > 0) {
-            lsp_parse_completions(json, lsp_request_prefix);
-            lsp.pending_completion_id = -1;
+static void lsp_w_escaped(LspWriter *w, const char *s, size_t n) {
+    size_t run = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        const char *esc = NULL;
+        char hex[8];
+        if (c == '"') esc = "\\\"";
+        else if (c == '\\') esc = "\\\\";
+        else if (c == '\n') esc = "\\n";
+        else if (c == '\r') esc = "\\r";
+        else if (c == '\t') esc = "\\t";
+        else if (c < 0x20) {
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            esc = hex;
         }
-
-        free(json);
-        size_t remain = lsp.read_len - header_len - (size_t)content_length;
-        memmove(lsp.read_buf, lsp.read_buf + header_len + (size_t)content_length, remain);
-        lsp.read_len = remain;
+        if (!esc) continue;
+        lsp_w_ref(w, s + run, i - run);
+        lsp_w_str(w, esc);
+        run = i + 1;
     }
+    lsp_w_ref(w, s + run, n - run);
 }
 
-static void lsp_prepare_for_file(const char *file, const SyntaxLang *lang) {
-    if (!is_lsp_lang(lang)) {
-        lsp_shutdown();
-        return;
-    }
-    const char *cmd = lsp_cmd_for_lang(lang->name);
-    if (!cmd || !cmd[0]) {
-        lsp_shutdown();
-        return;
+/* The whole buffer as the contents of a JSON string. */
+static void lsp_w_document(LspWriter *w) {
+    for (int i = 0; i < lines; i++) {
+        lsp_w_escaped(w, buf[i], strlen(buf[i]));
+        if (i < lines - 1) lsp_w_copy(w, "\\n", 2);
     }
-    if (!lsp.running || strcmp(lsp.server_name, lang->name) != 0) {
-        lsp_shutdown();
-        if (!lsp_spawn(cmd, lang->name)) {
-            set_status("LSP start failed: %s", cmd);
-            return;
+}
+
+static int lsp_send_body(LspBodyFn body, int kind) {
+    if (!lsp->running) return 0;
+    LspWriter *w = &lsp_w;
+    lsp_w_reset(w, 1, kind, NULL);
+    body(w);
+    if (w->failed) return 0;
+    size_t len = w->total;
+    lsp_w_reset(w, 0, kind, lsp->doc ? lsp->doc->uri : NULL);
+    lsp_w_printf(w, "Content-Length: %zu\r\n\r\n", len);
+    body(w);
+    lsp_w_flush(w);
+    return !w->failed;
+}
+
+static int lsp_send_raw(const char *json, size_t len) {
+    if (!lsp->running) return 0;
+    LspWriter *w = &lsp_w;
+    lsp_w_reset(w, 0, LSP_MSG_OTHER, NULL);
+    lsp_w_printf(w, "Content-Length: %zu\r\n\r\n", len);
+    lsp_w_ref(w, json, len);
+    lsp_w_flush(w);
+    return !w->failed;
+}
+
+static int lsp_send_fmt(const char *fmt, ...) {
+    char buf[8192];
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    int ok = 0;
+    if (len > 0 && (size_t)len < sizeof(buf)) {
+        ok = lsp_send_raw(buf, (size_t)len);
+    } else if (len > 0) {
+        char *big = (char *)malloc((size_t)len + 1);
+        if (big) {
+            vsnprintf(big, (size_t)len + 1, fmt, ap2);
+            ok = lsp_send_raw(big, (size_t)len);
+            free(big);
         }
-        char cwd_buf[PATH_MAX];
-        if (!getcwd(cwd_buf, sizeof(cwd_buf))) cwd_buf[0] = '\0';
-        make_file_uri(cwd_buf, lsp.root_uri, sizeof(lsp.root_uri));
-        lsp_send_initialize();
-    }
-    make_file_uri(file, lsp.doc_uri, sizeof(lsp.doc_uri));
-    if (strcmp(lang->name, "Assembly") == 0) {
-        strncpy(lsp.language_id, "asm", sizeof(lsp.language_id) - 1);
-    } else {
-        strncpy(lsp.language_id, "c", sizeof(lsp.language_id) - 1);
-    }
-    lsp.language_id[sizeof(lsp.language_id) - 1] = '\0';
-    lsp.needs_open = 1;
-    if (lsp.initialized) {
-        lsp_send_did_open();
-        lsp.needs_open = 0;
     }
+    va_end(ap2);
+    return ok;
 }
 
-static void lsp_request_completion(void) {
-    if (!lsp.running || !lsp.initialized) return;
-    int id = lsp.init_id + 100 + lsp.doc_version;
-    lsp.pending_completion_id = id;
-    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"textDocument/completion\",\"params\":{\"textDocument\":{\"uri\":\"%s\"},\"position\":{\"line\":%d,\"character\":%d}}}",
-                 id, lsp.doc_uri, cy, cx);
+static void lsp_doc_changes_clear(LspDoc *doc) {
+    for (int i = 0; i < doc->delta_count; i++) free(doc->deltas[i].text);
+    doc->delta_count = 0;
+    doc->change_full = 0;
 }
 
-static int get_word_prefix(char *out, size_t out_sz, int *start_out) {
-    if (!buf || cy < 0 || cy >= lines) return 0;
-    int start = cx;
+static void lsp_changes_clear(void) {
+    if (lsp->doc) lsp_doc_changes_clear(lsp->doc);
+    lsp->change_due_ms = 0;
+}
+
+/* Position just past the text a delta puts in. */
+static void lsp_delta_end(const LspDelta *d, int *line, int *col) {
+    *line = d->start_line;
+    *col = d->start_col;
+    for (size_t i = 0; i < d->len; i++) {
+        if (d->text[i] == '\n') { (*line)++; *col = 0; }
+        else (*col)++;
+    }
+}
+
+/* Fold a change into the last queued delta when the two touch, so a run of
+   typing, backspacing or forward deleting stays one delta. */
+static int lsp_delta_merge(LspDelta *d, int start_line, int start_col, int end_line, int end_col,
+                           const char *text, size_t len) {
+    int tl, tc;
+    lsp_delta_end(d, &tl, &tc);
+    if (start_line == tl && start_col == tc) {
+        /* Starts where d's text ends: whatever it removes lay right after
+           d's range in the older document. */
+        if (end_line == start_line) {
+            d->end_col += end_col - start_col;
+        } else {
+            d->end_line += end_line - start_line;
+            d->end_col = end_col;
+        }
+        if (len) {
+            char *p = (char *)realloc(d->text, d->len + len + 1);
+            if (!p) return 0;
+            memcpy(p + d->len, text, len);
+            d->len += len;
+            p[d->len] = '\0';
+            d->text = p;
+        }
+        return 1;
+    }
+    if (len || end_line != tl || end_col != tc) {
+        /* A deletion ending at d's range start only widens the range. */
+        if (!len && end_line == d->start_line && end_col == d->start_col) {
+            d->start_line = start_line;
+            d->start_col = start_col;
+            return 1;
+        }
+        return 0;
+    }
+    /* A deletion ending where d's text ends, i.e. backspacing over it. */
+    int l = d->start_line, c = d->start_col;
+    for (size_t i = 0; i <= d->len; i++) {
+        if (l == start_line && c == start_col) {
+            d->len = i;
+            d->text[i] = '\0';
+            return 1;
+        }
+        if (i == d->len) break;
+        if (d->text[i] == '\n') { l++; c = 0; }
+        else c++;
+    }
+    if (start_line < d->start_line || (start_line == d->start_line && start_col < d->start_col)) {
+        d->start_line = start_line;
+        d->start_col = start_col;
+        d->len = 0;
+        d->text[0] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+static void lsp_cache_drop(LspDoc *doc) {
+    free(doc->cache);
+    doc->cache = NULL;
+    doc->cache_count = 0;
+}
+
+static int lsp_word_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/* The completion list stays good while the word it was asked for only
+   grows: word characters typed into it. Anything else can declare or
+   remove names, or change what the word follows. */
+static int lsp_cache_survives(const LspDoc *doc, int start_line, int start_col, int end_line, int end_col,
+                              const char *text, size_t len) {
+    if (start_line != doc->cache_line || end_line != start_line || end_col != start_col) return 0;
+    if (start_col < doc->cache_col || len == 0) return 0;
+    for (int x = doc->cache_col; x < start_col; x++)
+        if (!lsp_word_char(buf[start_line][x])) return 0;
+    for (size_t i = 0; i < len; i++)
+        if (!lsp_word_char(text[i])) return 0;
+    return 1;
+}
+
+static void lsp_mark_full(void) {
+    lsp_changes_clear();
+    lsp->doc->change_full = 1;
+}
+
+/* The next didChange replaces the whole document; used for edits that are
+   not worth describing as ranges. */
+static void lsp_record_full(void) {
+    if (!lsp->doc) return;
+    lsp_cache_drop(lsp->doc);
+    if (lsp->doc->open) lsp_mark_full();
+}
+
+/* Queue the replacement of [start, end) by text. Called by the edit
+   primitives before they modify the buffer. Until the document is open on
+   the server nothing is recorded: didOpen sends the text as it is then. */
+static void lsp_record_change(int start_line, int start_col, int end_line, int end_col,
+                              const char *text, size_t len) {
+    LspDoc *doc = lsp->doc;
+    if (!doc) return;
+    if (doc->cache && !lsp_cache_survives(doc, start_line, start_col, end_line, end_col, text, len))
+        lsp_cache_drop(doc);
+    if (!doc->open || doc->change_full) return;
+    if (lsp->sync_kind != LSP_SYNC_INCREMENTAL) {
+        lsp_mark_full();
+        return;
+    }
+    if (doc->delta_count > 0 &&
+        lsp_delta_merge(&doc->deltas[doc->delta_count - 1], start_line, start_col, end_line, end_col, text, len))
+        return;
+    if (doc->delta_count >= LSP_MAX_DELTAS) {
+        lsp_mark_full();
+        return;
+    }
+    if (doc->delta_count == doc->delta_cap) {
+        int cap = doc->delta_cap ? doc->delta_cap * 2 : 16;
+        LspDelta *d = (LspDelta *)realloc(doc->deltas, (size_t)cap * sizeof(LspDelta));
+        if (!d) { lsp_mark_full(); return; }
+        doc->deltas = d;
+        doc->delta_cap = cap;
+    }
+    char *copy = (char *)malloc(len + 1);
+    if (!copy) { lsp_mark_full(); return; }
+    if (len) memcpy(copy, text, len);
+    copy[len] = '\0';
+    LspDelta *d = &doc->deltas[doc->delta_count++];
+    d->start_line = start_line;
+    d->start_col = start_col;
+    d->end_line = end_line;
+    d->end_col = end_col;
+    d->text = copy;
+    d->len = len;
+}
+
+/* Reading, framing and parsing run on a thread of their own, so responses
+   are decoded while the UI draws. It owns the server's stdout and hands
+   results to the UI thread as LspEvents on a single-producer,
+   single-consumer ring, then calls ui_wakeup(). The UI thread tells it
+   which response ids to expect, and what they answer, over a second ring.
+   Writes stay on the UI thread: they never block and stream straight from
+   the buffer lines, which only that thread may touch. */
+#define LSP_RING_SIZE 256   /* power of two */
+#define LSP_MAX_EXPECT 32
+
+typedef struct {
+    void *slot[LSP_RING_SIZE];
+    unsigned head;          /* advanced by the consumer */
+    unsigned tail;          /* advanced by the producer */
+} LspRing;
+
+static int lsp_ring_push(LspRing *r, void *v) {
+    unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail - head == LSP_RING_SIZE) return 0;
+    r->slot[tail & (LSP_RING_SIZE - 1)] = v;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *lsp_ring_pop(LspRing *r) {
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return NULL;
+    void *v = r->slot[head & (LSP_RING_SIZE - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return v;
+}
+
+enum { LSP_REQ_INIT, LSP_REQ_COMPLETION };
+
+typedef struct {
+    int id;
+    int kind;
+    char prefix[MAX_COMPLETION_LABEL];
+} LspExpect;
+
+enum { LSP_EV_INIT, LSP_EV_COMPLETION, LSP_EV_CLOSED };
+
+#define LSP_COMPLETION_MAX 2048   /* labels kept from one response */
+
+typedef struct {
+    int kind;
+    int id;
+    int sync_kind;
+    int utf8_positions;
+    int incomplete;       /* the server, or LSP_COMPLETION_MAX, held items back */
+    int count;
+    int cap;
+    char (*items)[MAX_COMPLETION_LABEL];
+} LspEvent;
+
+static void lsp_event_free(LspEvent *ev) {
+    free(ev->items);
+    free(ev);
+}
+
+typedef struct LspIo {
+    pthread_t thread;
+    int stopping;           /* I/O thread only */
+    int out_fd;
+    int stop_pipe[2];
+    char *rbuf;             /* received bytes not yet consumed, grows as needed */
+    size_t rlen;
+    size_t rcap;
+    LspExpect expect[LSP_MAX_EXPECT];   /* I/O thread only */
+    int nexpect;
+    LspRing to_io;          /* LspExpect *, UI -> I/O */
+    LspRing to_ui;          /* LspEvent *, I/O -> UI */
+} LspIo;
+
+/* Tell the I/O thread what response id answers; sent before the request. */
+static void lsp_expect(int id, int kind, const char *prefix) {
+    if (!lsp->io) return;
+    LspExpect *e = (LspExpect *)calloc(1, sizeof(*e));
+    if (!e) return;
+    e->id = id;
+    e->kind = kind;
+    if (prefix) snprintf(e->prefix, sizeof(e->prefix), "%s", prefix);
+    if (!lsp_ring_push(&lsp->io->to_io, e)) free(e);
+}
+
+static void lsp_io_stop(LspIo *io) {
+    if (!io) return;
+    ssize_t w = write(io->stop_pipe[1], "x", 1);
+    (void)w;
+    pthread_join(io->thread, NULL);
+    close(io->stop_pipe[0]);
+    close(io->stop_pipe[1]);
+    close(io->out_fd);
+    void *v;
+    while ((v = lsp_ring_pop(&io->to_io)) != NULL) free(v);
+    while ((v = lsp_ring_pop(&io->to_ui)) != NULL) lsp_event_free((LspEvent *)v);
+    free(io->rbuf);
+    free(io);
+}
+
+static void *lsp_io_main(void *arg);
+
+static LspIo *lsp_io_start(int out_fd) {
+    LspIo *io = (LspIo *)calloc(1, sizeof(*io));
+    if (!io) return NULL;
+    if (pipe(io->stop_pipe) != 0) {
+        free(io);
+        return NULL;
+    }
+    fcntl(io->stop_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(io->stop_pipe[1], F_SETFD, FD_CLOEXEC);
+    io->out_fd = out_fd;
+    if (pthread_create(&io->thread, NULL, lsp_io_main, io) != 0) {
+        close(io->stop_pipe[0]);
+        close(io->stop_pipe[1]);
+        free(io);
+        return NULL;
+    }
+    return io;
+}
+
+static void lsp_doc_free(LspDoc *doc) {
+    lsp_doc_changes_clear(doc);
+    free(doc->deltas);
+    free(doc->cache);
+    free(doc->uri);
+    free(doc);
+}
+
+/* Servers told to exit are reaped from lsp_poll rather than waited for: one
+   that is slow to exit, or ignores SIGTERM, must not freeze the editor.
+   Whatever is still around after LSP_EXIT_GRACE_MS gets SIGKILL. */
+#define LSP_EXIT_GRACE_MS 500
+#define LSP_MAX_EXITING 16
+
+typedef struct {
+    pid_t pid;
+    long long due_ms;   /* SIGKILL, or the next check once it was sent */
+    int killed;
+} LspExiting;
+
+static LspExiting lsp_exiting[LSP_MAX_EXITING];
+static int lsp_exiting_count = 0;
+
+static void lsp_reap_later(pid_t pid) {
+    if (waitpid(pid, NULL, WNOHANG) != 0) return;
+    if (lsp_exiting_count == LSP_MAX_EXITING) {
+        /* Out of room: the oldest has had its grace period. */
+        kill(lsp_exiting[0].pid, SIGKILL);
+        waitpid(lsp_exiting[0].pid, NULL, 0);
+        memmove(&lsp_exiting[0], &lsp_exiting[1], (LSP_MAX_EXITING - 1) * sizeof(LspExiting));
+        lsp_exiting_count--;
+    }
+    LspExiting *e = &lsp_exiting[lsp_exiting_count++];
+    e->pid = pid;
+    e->due_ms = now_ms() + LSP_EXIT_GRACE_MS;
+    e->killed = 0;
+}
+
+static void lsp_reap_exiting(long long now) {
+    int n = 0;
+    for (int i = 0; i < lsp_exiting_count; i++) {
+        LspExiting *e = &lsp_exiting[i];
+        pid_t r = waitpid(e->pid, NULL, WNOHANG);
+        if (r == e->pid || (r < 0 && errno == ECHILD)) continue;
+        if (now >= e->due_ms) {
+            if (!e->killed) kill(e->pid, SIGKILL);
+            e->killed = 1;
+            e->due_ms = now + LSP_EXIT_GRACE_MS / 10;
+        }
+        lsp_exiting[n++] = *e;
+    }
+    lsp_exiting_count = n;
+}
+
+static void lsp_shutdown(void) {
+    if (!lsp->running) return;
+    /* Only the active server has a document, and maybe the popup. */
+    if (lsp->doc && completion_from_lsp) completion_clear();
+    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"shutdown\"}", lsp->next_id++);
+    const char *exit_msg = "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}";
+    lsp_send_raw(exit_msg, strlen(exit_msg));
+    lsp_wq_drain();
+    lsp_wq_clear();
+    close(lsp->in_fd);
+    if (lsp->pid > 0) {
+        kill(lsp->pid, SIGTERM);
+        lsp_reap_later(lsp->pid);
+    }
+    lsp_io_stop(lsp->io);
+    while (lsp->docs) {
+        LspDoc *doc = lsp->docs;
+        lsp->docs = doc->next;
+        lsp_doc_free(doc);
+    }
+    memset(lsp, 0, sizeof(*lsp));
+}
+
+static int lsp_spawn(const char *cmd, const char *server_name) {
+    int inpipe[2];
+    int outpipe[2];
+    if (pipe(inpipe) != 0) return 0;
+    if (pipe(outpipe) != 0) {
+        close(inpipe[0]); close(inpipe[1]);
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(inpipe[0]); close(inpipe[1]);
+        close(outpipe[0]); close(outpipe[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        dup2(inpipe[0], STDIN_FILENO);
+        dup2(outpipe[1], STDOUT_FILENO);
+        close(inpipe[1]);
+        close(outpipe[0]);
+        const int max_args = 8;
+        char *argv[max_args + 1];
+        char cmd_copy[256];
+        strncpy(cmd_copy, cmd, sizeof(cmd_copy) - 1);
+        cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+        int argc = 0;
+        char *tok = strtok(cmd_copy, " ");
+        while (tok && argc < max_args) {
+            argv[argc++] = tok;
+            tok = strtok(NULL, " ");
+        }
+        argv[argc] = NULL;
+        execvp(argv[0], argv);
+        _exit(1);
+    }
+
+    close(inpipe[0]);
+    close(outpipe[1]);
+    int flags = fcntl(outpipe[0], F_GETFL, 0);
+    fcntl(outpipe[0], F_SETFL, flags | O_NONBLOCK);
+    flags = fcntl(inpipe[1], F_GETFL, 0);
+    fcntl(inpipe[1], F_SETFL, flags | O_NONBLOCK);
+    /* Servers spawned later must not hold this one's pipes open. */
+    fcntl(outpipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(inpipe[1], F_SETFD, FD_CLOEXEC);
+
+    LspIo *io = lsp_io_start(outpipe[0]);
+    if (!io) {
+        close(inpipe[1]);
+        close(outpipe[0]);
+        kill(pid, SIGTERM);
+        lsp_reap_later(pid);
+        return 0;
+    }
+    memset(lsp, 0, sizeof(*lsp));
+    lsp->io = io;
+    lsp->running = 1;
+    lsp->initialized = 0;
+    lsp->pid = pid;
+    lsp->in_fd = inpipe[1];
+    lsp->pending_completion_id = -1;
+    lsp->next_id = 1;
+    lsp->sync_kind = LSP_SYNC_FULL;
+    strncpy(lsp->server_name, server_name ? server_name : "lsp", sizeof(lsp->server_name) - 1);
+    return 1;
+}
+
+static void lsp_send_initialize(void) {
+    int pid = (int)getpid();
+    int id = lsp->next_id++;
+    lsp_expect(id, LSP_REQ_INIT, NULL);
+    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"initialize\",\"params\":{\"processId\":%d,\"rootUri\":\"%s\",\"capabilities\":{\"general\":{\"positionEncodings\":[\"utf-8\"]},\"offsetEncoding\":[\"utf-8\"],\"textDocument\":{\"synchronization\":{\"dynamicRegistration\":false},\"completion\":{\"completionItem\":{\"snippetSupport\":false}}}}}}",
+                 id, pid, lsp->root_uri);
+}
+
+static void lsp_send_initialized(void) {
+    const char *msg = "{\"jsonrpc\":\"2.0\",\"method\":\"initialized\",\"params\":{}}";
+    lsp_send_raw(msg, strlen(msg));
+}
+
+static void lsp_body_did_open(LspWriter *w) {
+    lsp_w_printf(w, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":{\"uri\":\"%s\",\"languageId\":\"%s\",\"version\":%d,\"text\":\"",
+                 lsp->doc->uri, lsp->doc->language_id, lsp->doc->version);
+    lsp_w_document(w);
+    lsp_w_str(w, "\"}}}");
+}
+
+static LspDoc *lsp_doc_find(const char *uri) {
+    for (LspDoc *doc = lsp->docs; doc; doc = doc->next) {
+        if (strcmp(doc->uri, uri) == 0) return doc;
+    }
+    return NULL;
+}
+
+static LspDoc *lsp_doc_get(const char *uri) {
+    LspDoc *doc = lsp_doc_find(uri);
+    if (doc) return doc;
+    doc = (LspDoc *)calloc(1, sizeof(LspDoc));
+    if (!doc) return NULL;
+    doc->uri = strdup(uri);
+    if (!doc->uri) {
+        free(doc);
+        return NULL;
+    }
+    doc->next = lsp->docs;
+    lsp->docs = doc;
+    return doc;
+}
+
+static void lsp_doc_remove(LspDoc *doc) {
+    LspDoc **pp = &lsp->docs;
+    while (*pp && *pp != doc) pp = &(*pp)->next;
+    if (*pp) *pp = doc->next;
+    if (lsp->doc == doc) {
+        lsp->doc = NULL;
+        lsp->change_due_ms = 0;
+    }
+    lsp_doc_free(doc);
+}
+
+static void lsp_send_did_open(void) {
+    lsp_changes_clear();
+    lsp->doc->version = 1;
+    lsp_send_body(lsp_body_did_open, LSP_MSG_OTHER);
+    lsp->doc->open = 1;
+}
+
+static void lsp_body_did_change(LspWriter *w) {
+    lsp_w_printf(w, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":\"%s\",\"version\":%d},\"contentChanges\":[",
+                 lsp->doc->uri, lsp->doc->version);
+    if (lsp->doc->change_full) {
+        lsp_w_str(w, "{\"text\":\"");
+        lsp_w_document(w);
+        lsp_w_str(w, "\"}");
+    } else {
+        for (int i = 0; i < lsp->doc->delta_count; i++) {
+            const LspDelta *d = &lsp->doc->deltas[i];
+            lsp_w_printf(w, "%s{\"range\":{\"start\":{\"line\":%d,\"character\":%d},\"end\":{\"line\":%d,\"character\":%d}},\"text\":\"",
+                         i ? "," : "", d->start_line, d->start_col, d->end_line, d->end_col);
+            lsp_w_escaped(w, d->text, d->len);
+            lsp_w_str(w, "\"}");
+        }
+    }
+    lsp_w_str(w, "]}}");
+}
+
+/* Send what changed since the last didChange: the queued range deltas when
+   the server takes incremental sync, the whole document otherwise. */
+static void lsp_send_did_change(void) {
+    TRACE_SCOPE("lsp_send_did_change");
+    LspDoc *doc = lsp->doc;
+    if (!doc || !doc->open) return;
+    if (!doc->change_full && doc->delta_count == 0) return;
+    if (lsp->sync_kind == LSP_SYNC_NONE) {
+        lsp_changes_clear();
+        return;
+    }
+    long long t0 = stats_now_us();
+    doc->version++;
+    lsp_send_body(lsp_body_did_change, doc->change_full ? LSP_MSG_SYNC_FULL : LSP_MSG_SYNC);
+    lsp_changes_clear();
+    stats_add(STAT_LSP, t0);
+}
+
+/* Arm the debounce for whatever is queued. Each edit pushes the deadline
+   out, up to LSP_CHANGE_MAX_WAIT periods after the first one. */
+static void lsp_schedule_did_change(void) {
+    if (!lsp->doc || (!lsp->doc->change_full && lsp->doc->delta_count == 0)) return;
+    if (lsp_debounce_ms <= 0) {
+        lsp_send_did_change();
+        return;
+    }
+    long long now = now_ms();
+    if (!lsp->change_due_ms) lsp->change_first_ms = now;
+    lsp->change_due_ms = now + lsp_debounce_ms;
+    long long cap = lsp->change_first_ms + (long long)lsp_debounce_ms * LSP_CHANGE_MAX_WAIT;
+    if (lsp->change_due_ms > cap) lsp->change_due_ms = cap;
+}
+
+/* Incoming messages are read with a small pull parser over the byte range
+   of one message: nothing is allocated or NUL-terminated, and the parts of
+   a message nobody asked for are skipped, so each one is scanned once. */
+typedef struct {
+    const char *p;
+    const char *end;
+    int err;
+} JsonCur;
+
+static int json_peek(JsonCur *c) {
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) c->p++;
+    return c->p < c->end ? (unsigned char)*c->p : 0;
+}
+
+static int json_expect(JsonCur *c, int ch) {
+    if (json_peek(c) != ch) {
+        c->err = 1;
+        return 0;
+    }
+    c->p++;
+    return 1;
+}
+
+/* The undecoded contents of the string at the cursor. */
+static int json_raw_string(JsonCur *c, const char **s, size_t *n) {
+    if (!json_expect(c, '"')) return 0;
+    const char *start = c->p;
+    while (c->p < c->end && *c->p != '"') {
+        if (*c->p == '\\') c->p++;
+        c->p++;
+    }
+    if (c->p >= c->end) {
+        c->err = 1;
+        return 0;
+    }
+    *s = start;
+    *n = (size_t)(c->p - start);
+    c->p++;
+    return 1;
+}
+
+static int json_delim(int ch) {
+    return ch == ',' || ch == ':' || ch == '}' || ch == ']';
+}
+
+static void json_skip(JsonCur *c) {
+    int depth = 0;
+    do {
+        int ch = json_peek(c);
+        const char *s;
+        size_t n;
+        if (ch == '"') {
+            if (!json_raw_string(c, &s, &n)) return;
+        } else if (ch == '{' || ch == '[') {
+            depth++;
+            c->p++;
+        } else if (json_delim(ch) && depth > 0) {
+            if (ch == '}' || ch == ']') depth--;
+            c->p++;
+        } else if (ch && !json_delim(ch)) {
+            while (c->p < c->end && !json_delim((unsigned char)*c->p) && !isspace((unsigned char)*c->p)) c->p++;
+        } else {
+            c->err = 1;
+            return;
+        }
+    } while (depth > 0);
+}
+
+/* Object walk: after json_expect(c, '{'), each call stops at the next
+   member's value, which the caller must read or skip. */
+static int json_member(JsonCur *c, const char **key, size_t *klen) {
+    int ch = json_peek(c);
+    if (ch == ',') {
+        c->p++;
+        ch = json_peek(c);
+    }
+    if (ch == '}') {
+        c->p++;
+        return 0;
+    }
+    return json_raw_string(c, key, klen) && json_expect(c, ':');
+}
+
+/* Array walk: after json_expect(c, '['), each call stops at the next
+   element, which the caller must read or skip. */
+static int json_element(JsonCur *c) {
+    int ch = json_peek(c);
+    if (ch == ',') {
+        c->p++;
+        ch = json_peek(c);
+    }
+    if (ch == ']') {
+        c->p++;
+        return 0;
+    }
+    return ch != 0 && !c->err;
+}
+
+static int json_key(const char *key, size_t klen, const char *want) {
+    return strlen(want) == klen && memcmp(key, want, klen) == 0;
+}
+
+static int json_int(JsonCur *c, int *out) {
+    int ch = json_peek(c);
+    if (ch != '-' && !isdigit(ch)) {
+        json_skip(c);
+        return 0;
+    }
+    int neg = (ch == '-');
+    if (neg) c->p++;
+    long v = 0;
+    while (c->p < c->end && isdigit((unsigned char)*c->p)) {
+        if (v < INT_MAX) v = v * 10 + (*c->p - '0');
+        c->p++;
+    }
+    if (c->p < c->end && !json_delim((unsigned char)*c->p) && !isspace((unsigned char)*c->p)) json_skip(c);
+    *out = (int)(neg ? -v : v);
+    return 1;
+}
+
+static int json_bool(JsonCur *c, int *out) {
+    int ch = json_peek(c);
+    if (ch != 't' && ch != 'f') {
+        json_skip(c);
+        return 0;
+    }
+    *out = (ch == 't');
+    json_skip(c);
+    return 1;
+}
+
+static unsigned json_hex4(const char *s) {
+    unsigned v = 0;
+    for (int k = 0; k < 4; k++) {
+        int h = tolower((unsigned char)s[k]);
+        v = v * 16 + (unsigned)(isdigit(h) ? h - '0' : h - 'a' + 10);
+    }
+    return v;
+}
+
+/* Decode the string at the cursor into out, cutting it to fit. */
+static int json_string(JsonCur *c, char *out, size_t out_sz) {
+    const char *s;
+    size_t n;
+    if (json_peek(c) != '"') {
+        json_skip(c);
+        return 0;
+    }
+    if (!json_raw_string(c, &s, &n)) return 0;
+    size_t o = 0;
+    for (size_t i = 0; i < n && o + 1 < out_sz; i++) {
+        char ch = s[i];
+        if (ch == '\\' && i + 1 < n) {
+            char e = s[++i];
+            if (e == 'n') ch = '\n';
+            else if (e == 't') ch = '\t';
+            else if (e == 'r') ch = '\r';
+            else if (e == 'b') ch = '\b';
+            else if (e == 'f') ch = '\f';
+            else if (e == 'u' && i + 4 < n) {
+                unsigned cp = json_hex4(s + i + 1);
+                i += 4;
+                /* A high surrogate followed by \uDCxx is one code point. */
+                if (cp >= 0xd800 && cp < 0xdc00 && i + 6 < n && s[i + 1] == '\\' && s[i + 2] == 'u') {
+                    unsigned lo = json_hex4(s + i + 3);
+                    if (lo >= 0xdc00 && lo < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        i += 6;
+                    }
+                }
+                /* Half a pair is not a character: U+FFFD stands in for it. */
+                if (cp >= 0xd800 && cp < 0xe000) cp = 0xfffd;
+                char utf[4];
+                size_t ulen;
+                if (cp < 0x80) {
+                    utf[0] = (char)cp;
+                    ulen = 1;
+                } else if (cp < 0x800) {
+                    utf[0] = (char)(0xc0 | (cp >> 6));
+                    utf[1] = (char)(0x80 | (cp & 0x3f));
+                    ulen = 2;
+                } else if (cp < 0x10000) {
+                    utf[0] = (char)(0xe0 | (cp >> 12));
+                    utf[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf[2] = (char)(0x80 | (cp & 0x3f));
+                    ulen = 3;
+                } else {
+                    utf[0] = (char)(0xf0 | (cp >> 18));
+                    utf[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+                    utf[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf[3] = (char)(0x80 | (cp & 0x3f));
+                    ulen = 4;
+                }
+                if (o + ulen >= out_sz) break;
+                memcpy(out + o, utf, ulen);
+                o += ulen;
+                continue;
+            }
+            else ch = e;
+        }
+        out[o++] = ch;
+    }
+    out[o] = '\0';
+    return 1;
+}
+
+/* The position encoding the server settled on: capabilities.positionEncoding,
+   or clangd's older offsetEncoding next to it. Absent means UTF-16. */
+static void lsp_parse_encoding(JsonCur *c, LspEvent *ev) {
+    char enc[16];
+    if (json_string(c, enc, sizeof(enc))) ev->utf8_positions = (strcmp(enc, "utf-8") == 0);
+}
+
+/* textDocumentSync is either a kind or an options object whose change
+   member defaults to none. A server that names neither gets full sync. */
+static void lsp_parse_init(JsonCur *c, LspEvent *ev) {
+    int kind = LSP_SYNC_FULL;
+    const char *key;
+    size_t klen;
+    ev->sync_kind = kind;
+    if (json_peek(c) != '{') {
+        json_skip(c);
+        return;
+    }
+    c->p++;
+    while (json_member(c, &key, &klen)) {
+        if (json_key(key, klen, "offsetEncoding")) {
+            lsp_parse_encoding(c, ev);
+            continue;
+        }
+        if (!json_key(key, klen, "capabilities") || json_peek(c) != '{') {
+            json_skip(c);
+            continue;
+        }
+        c->p++;
+        while (json_member(c, &key, &klen)) {
+            if (json_key(key, klen, "positionEncoding")) {
+                lsp_parse_encoding(c, ev);
+            } else if (!json_key(key, klen, "textDocumentSync")) {
+                json_skip(c);
+            } else if (json_peek(c) == '{') {
+                c->p++;
+                kind = LSP_SYNC_NONE;
+                while (json_member(c, &key, &klen)) {
+                    if (json_key(key, klen, "change")) json_int(c, &kind);
+                    else json_skip(c);
+                }
+            } else {
+                json_int(c, &kind);
+            }
+        }
+    }
+    if (kind < LSP_SYNC_NONE || kind > LSP_SYNC_INCREMENTAL) kind = LSP_SYNC_FULL;
+    ev->sync_kind = kind;
+}
+
+static void lsp_parse_completion_items(JsonCur *c, const char *prefix, size_t prefix_len, LspEvent *ev) {
+    if (!json_expect(c, '[')) return;
+    while (json_element(c)) {
+        if (json_peek(c) != '{') {
+            json_skip(c);
+            continue;
+        }
+        c->p++;
+        char label[MAX_COMPLETION_LABEL] = "";
+        const char *key;
+        size_t klen;
+        while (json_member(c, &key, &klen)) {
+            if (json_key(key, klen, "label")) json_string(c, label, sizeof(label));
+            else json_skip(c);
+        }
+        if (!label[0] || (prefix_len && strncmp(label, prefix, prefix_len) != 0)) continue;
+        if (ev->count == ev->cap) {
+            int cap = ev->cap ? ev->cap * 2 : 64;
+            void *p = cap <= LSP_COMPLETION_MAX ? realloc(ev->items, (size_t)cap * sizeof(*ev->items)) : NULL;
+            if (!p) {
+                ev->incomplete = 1;
+                continue;
+            }
+            ev->items = (char (*)[MAX_COMPLETION_LABEL])p;
+            ev->cap = cap;
+        }
+        memcpy(ev->items[ev->count++], label, sizeof(label));
+    }
+}
+
+/* The result is a CompletionItem[] or a CompletionList holding items. */
+static void lsp_parse_completions(JsonCur *c, const char *prefix, LspEvent *ev) {
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    int ch = json_peek(c);
+    if (ch == '[') {
+        lsp_parse_completion_items(c, prefix, prefix_len, ev);
+    } else if (ch == '{') {
+        c->p++;
+        const char *key;
+        size_t klen;
+        while (json_member(c, &key, &klen)) {
+            if (json_key(key, klen, "items") && json_peek(c) == '[') lsp_parse_completion_items(c, prefix, prefix_len, ev);
+            else if (json_key(key, klen, "isIncomplete")) json_bool(c, &ev->incomplete);
+            else json_skip(c);
+        }
+    } else {
+        json_skip(c);
+    }
+}
+
+/* Find and forget the expectation registered for a response id. */
+static int lsp_io_take_expect(LspIo *io, int id, LspExpect *out) {
+    for (int i = 0; i < io->nexpect; i++) {
+        if (io->expect[i].id != id) continue;
+        *out = io->expect[i];
+        memmove(&io->expect[i], &io->expect[i + 1],
+                (size_t)(io->nexpect - i - 1) * sizeof(LspExpect));
+        io->nexpect--;
+        return 1;
+    }
+    return 0;
+}
+
+/* Take the expectations the UI thread queued. Requests the server never
+   answers would fill the table, so the oldest one makes room. */
+static void lsp_io_collect_expects(LspIo *io) {
+    LspExpect *e;
+    while ((e = (LspExpect *)lsp_ring_pop(&io->to_io)) != NULL) {
+        if (io->nexpect == LSP_MAX_EXPECT) {
+            memmove(&io->expect[0], &io->expect[1], (LSP_MAX_EXPECT - 1) * sizeof(LspExpect));
+            io->nexpect--;
+        }
+        io->expect[io->nexpect++] = *e;
+        free(e);
+    }
+}
+
+/* Hand ev to the UI thread, waiting while the ring is full. Gives up, and
+   frees ev, when asked to stop meanwhile. */
+static void lsp_io_emit(LspIo *io, LspEvent *ev) {
+    while (!lsp_ring_push(&io->to_ui, ev)) {
+        struct pollfd p = { io->stop_pipe[0], POLLIN, 0 };
+        if (poll(&p, 1, 1) > 0) {
+            lsp_event_free(ev);
+            io->stopping = 1;
+            return;
+        }
+    }
+    ui_wakeup();
+}
+
+/* Consume the result of the response with this id. */
+static void lsp_io_result(LspIo *io, int id, JsonCur *c) {
+    LspExpect ex;
+    if (!lsp_io_take_expect(io, id, &ex)) {
+        json_skip(c);
+        return;
+    }
+    LspEvent *ev = (LspEvent *)calloc(1, sizeof(*ev));
+    if (!ev) {
+        json_skip(c);
+        return;
+    }
+    ev->id = id;
+    if (ex.kind == LSP_REQ_INIT) {
+        ev->kind = LSP_EV_INIT;
+        lsp_parse_init(c, ev);
+    } else {
+        ev->kind = LSP_EV_COMPLETION;
+        lsp_parse_completions(c, ex.prefix, ev);
+    }
+    lsp_io_emit(io, ev);
+}
+
+static void lsp_io_message(LspIo *io, const char *msg, size_t len) {
+    JsonCur c = { msg, msg + len, 0 };
+    if (!json_expect(&c, '{')) return;
+    int id = -1, has_id = 0, is_request = 0, is_error = 0;
+    JsonCur result = { NULL, NULL, 1 };
+    const char *key;
+    size_t klen;
+    while (!c.err && json_member(&c, &key, &klen)) {
+        if (json_key(key, klen, "id")) {
+            has_id = json_int(&c, &id);
+        } else if (json_key(key, klen, "method")) {
+            is_request = 1;
+            json_skip(&c);
+        } else if (json_key(key, klen, "result") && has_id) {
+            /* Servers send the id first in practice: parse in place. */
+            lsp_io_result(io, id, &c);
+            return;
+        } else if (json_key(key, klen, "result")) {
+            result = c;
+            json_skip(&c);
+        } else if (json_key(key, klen, "error")) {
+            /* Cancelled requests usually end here. */
+            is_error = 1;
+            json_skip(&c);
+        } else {
+            json_skip(&c);
+        }
+    }
+    if (!has_id || is_request) return;
+    if (!result.err) {
+        lsp_io_result(io, id, &result);
+    } else if (is_error) {
+        LspExpect ex;
+        lsp_io_take_expect(io, id, &ex);
+    }
+}
+
+/* Content-Length from the header block [h, end), or -1. */
+static long lsp_content_length(const char *h, const char *end) {
+    static const char name[] = "content-length:";
+    size_t n = sizeof(name) - 1;
+    while (h < end) {
+        const char *eol = h;
+        while (eol < end && *eol != '\r' && *eol != '\n') eol++;
+        size_t i = 0;
+        while (i < n && h + i < eol && tolower((unsigned char)h[i]) == name[i]) i++;
+        if (i == n) {
+            const char *p = h + n;
+            while (p < eol && *p == ' ') p++;
+            long v = 0;
+            while (p < eol && isdigit((unsigned char)*p) && v < LONG_MAX / 10) v = v * 10 + (*p++ - '0');
+            return v;
+        }
+        h = eol;
+        while (h < end && (*h == '\r' || *h == '\n')) h++;
+    }
+    return -1;
+}
+
+#define LSP_MAX_MESSAGE (64L * 1024 * 1024)
+
+/* Read what the server has written and handle every complete message.
+   Returns 0 once the pipe is closed or unusable. */
+static int lsp_io_read(LspIo *io) {
+    int eof = 0;
+    for (;;) {
+        if (io->rcap - io->rlen < 4096) {
+            size_t cap = io->rcap ? io->rcap * 2 : 65536;
+            char *p = (char *)realloc(io->rbuf, cap);
+            if (!p) return 0;
+            io->rbuf = p;
+            io->rcap = cap;
+        }
+        ssize_t n = read(io->out_fd, io->rbuf + io->rlen, io->rcap - io->rlen);
+        if (n > 0) {
+            io->rlen += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return 0;
+    }
+
+    size_t pos = 0;
+    while (pos < io->rlen) {
+        const char *start = io->rbuf + pos;
+        const char *end = io->rbuf + io->rlen;
+        const char *body = NULL;
+        for (const char *q = start; q + 3 < end; q++) {
+            if (q[0] == '\r' && q[1] == '\n' && q[2] == '\r' && q[3] == '\n') {
+                body = q + 4;
+                break;
+            }
+        }
+        if (!body) break;
+        long len = lsp_content_length(start, body);
+        if (len < 0) {
+            pos = (size_t)(body - io->rbuf);   /* no length: resync on the next header */
+            continue;
+        }
+        if (len > LSP_MAX_MESSAGE) return 0;
+        if ((size_t)(end - body) < (size_t)len) break;
+        lsp_io_collect_expects(io);
+        lsp_io_message(io, body, (size_t)len);
+        if (io->stopping) return 0;
+        pos = (size_t)(body - io->rbuf) + (size_t)len;
+    }
+    if (pos > 0) {
+        memmove(io->rbuf, io->rbuf + pos, io->rlen - pos);
+        io->rlen -= pos;
+    }
+    return !eof;
+}
+
+static void lsp_io_run(LspIo *io) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            { io->out_fd, POLLIN, 0 },
+            { io->stop_pipe[0], POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) return;
+        if (fds[0].revents && !lsp_io_read(io)) break;
+    }
+    if (io->stopping) return;
+    LspEvent *ev = (LspEvent *)calloc(1, sizeof(*ev));
+    if (ev) {
+        ev->kind = LSP_EV_CLOSED;
+        lsp_io_emit(io, ev);
+    }
+}
+
+static void *lsp_io_main(void *arg) {
+    trace_thread_name("lsp-io");
+    lsp_io_run((LspIo *)arg);
+    trace_thread_exit();
+    return NULL;
+}
+
+/* Tell the server the outstanding completion request is not wanted. */
+static void lsp_cancel_completion(void) {
+    if (lsp->pending_completion_id <= 0) return;
+    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"method\":\"$/cancelRequest\",\"params\":{\"id\":%d}}",
+                 lsp->pending_completion_id);
+    lsp->pending_completion_id = -1;
+}
+
+/* Whether the document and cursor are still as they were when the pending
+   completion was requested; an answer for anything else is stale. */
+static int lsp_completion_current(void) {
+    const LspDoc *doc = lsp->doc;
+    return doc && doc == lsp->completion_doc && doc->version == lsp->completion_version &&
+           !doc->change_full && doc->delta_count == 0 &&
+           cy == lsp->completion_line && cx == lsp->completion_col;
+}
+
+/* Fill the popup with the cached labels that start with prefix. */
+static void lsp_cache_show(const char *prefix) {
+    const LspDoc *doc = lsp->doc;
+    size_t n = strlen(prefix);
+    completion_clear();
+    completion_from_lsp = 1;
+    for (int i = 0; i < doc->cache_count && completion_count < MAX_COMPLETIONS; i++) {
+        if (strncmp(doc->cache[i], prefix, n) != 0) continue;
+        memcpy(completion_items[completion_count++], doc->cache[i], MAX_COMPLETION_LABEL);
+    }
+    if (completion_count > 0) completion_active = 1;
+}
+
+static void lsp_apply_event(LspEvent *ev) {
+    switch (ev->kind) {
+    case LSP_EV_INIT:
+        if (lsp->initialized) break;
+        lsp->initialized = 1;
+        lsp->sync_kind = ev->sync_kind;
+        lsp->utf8_positions = ev->utf8_positions;
+        /* Ranged edits carry byte columns; a UTF-16 server gets whole texts. */
+        if (lsp->sync_kind == LSP_SYNC_INCREMENTAL && !lsp->utf8_positions)
+            lsp->sync_kind = LSP_SYNC_FULL;
+        lsp_send_initialized();
+        if (lsp->doc) lsp_send_did_open();
+        break;
+    case LSP_EV_COMPLETION:
+        if (ev->id != lsp->pending_completion_id || lsp->pending_completion_id <= 0) break;
+        lsp->pending_completion_id = -1;
+        if (!lsp_completion_current()) break;
+        free(lsp->doc->cache);
+        lsp->doc->cache = ev->items;
+        ev->items = NULL;
+        lsp->doc->cache_count = ev->count;
+        lsp->doc->cache_incomplete = ev->incomplete;
+        lsp->doc->cache_line = lsp->completion_line;
+        lsp->doc->cache_col = lsp->completion_start;
+        snprintf(lsp->doc->cache_prefix, sizeof(lsp->doc->cache_prefix), "%s", lsp_request_prefix);
+        lsp_cache_show(lsp_request_prefix);
+        break;
+    case LSP_EV_CLOSED:
+        lsp_shutdown();
+        break;
+    }
+}
+
+static void lsp_poll_server(void) {
+    if (lsp->wq_head) {
+        if (!lsp_wq_drain()) {
+            lsp_shutdown();
+            return;
+        }
+        /* Changes held back while the pipe was full go out now. */
+        if (!lsp->wq_head && lsp->change_due_ms == 0) lsp_schedule_did_change();
+    }
+    LspEvent *ev;
+    while (lsp->running && (ev = (LspEvent *)lsp_ring_pop(&lsp->io->to_ui)) != NULL) {
+        lsp_apply_event(ev);
+        lsp_event_free(ev);
+    }
+}
+
+/* When the next idle server is due to be shut down, or an exiting one
+   checked on, or 0. */
+static long long lsp_reap_due_ms(void) {
+    long long due = 0;
+    for (int i = 0; i < lsp_exiting_count; i++)
+        if (!due || lsp_exiting[i].due_ms < due) due = lsp_exiting[i].due_ms;
+    if (lsp_idle_timeout <= 0) return due;
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        LspClient *c = &lsp_pool[i];
+        if (!c->running || c == lsp) continue;
+        long long t = c->idle_since_ms + lsp_idle_timeout * 1000LL;
+        if (!due || t < due) due = t;
+    }
+    return due;
+}
+
+static void lsp_poll(void) {
+    TRACE_SCOPE("lsp_poll");
+    LspClient *active = lsp;
+    long long now = now_ms();
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        lsp = &lsp_pool[i];
+        if (!lsp->running) continue;
+        lsp_poll_server();
+        if (lsp->running && lsp != active && lsp_idle_timeout > 0 &&
+            now - lsp->idle_since_ms >= lsp_idle_timeout * 1000LL)
+            lsp_shutdown();
+    }
+    lsp = active;
+    if (lsp_exiting_count) lsp_reap_exiting(now);
+}
+
+static void lsp_pool_shutdown(void) {
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        lsp = &lsp_pool[i];
+        lsp_shutdown();
+    }
+    lsp = &lsp_none;
+    /* On the way out the grace period is waited for, with a bound. */
+    long long give_up = now_ms() + 2 * LSP_EXIT_GRACE_MS;
+    while (lsp_exiting_count && now_ms() < give_up) {
+        lsp_reap_exiting(now_ms());
+        if (lsp_exiting_count) poll(NULL, 0, 10);
+    }
+}
+
+/* The active document goes into the background. Its changes were normally
+   flushed before the buffer was swapped out; any left wait for its return. */
+static void lsp_leave_document(void) {
+    if (!lsp->running) return;
+    lsp_cancel_completion();
+    lsp->doc = NULL;
+    lsp->change_due_ms = 0;
+    lsp->idle_since_ms = now_ms();
+}
+
+/* Make file the active document. One the server already has open costs
+   nothing unless it has changes pending. */
+static void lsp_enter_document(const char *file, const SyntaxLang *lang) {
+    char uri[PATH_MAX * 2];
+    make_file_uri(file, uri, sizeof(uri));
+    LspDoc *doc = lsp_doc_get(uri);
+    if (!doc) return;
+    snprintf(doc->language_id, sizeof(doc->language_id), "%s",
+             strcmp(lang->name, "Assembly") == 0 ? "asm" : "c");
+    lsp->doc = doc;
+    if (!lsp->initialized) return;   /* opened once the server is up */
+    if (!doc->open) lsp_send_did_open();
+    else lsp_send_did_change();
+}
+
+static LspClient *lsp_pool_find(const char *name, const char *root_uri) {
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        LspClient *c = &lsp_pool[i];
+        if (c->running && strcmp(c->server_name, name) == 0 && strcmp(c->root_uri, root_uri) == 0) return c;
+    }
+    return NULL;
+}
+
+/* A free slot; when the pool is full the server idle longest makes room. */
+static LspClient *lsp_pool_slot(void) {
+    LspClient *lru = NULL;
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        LspClient *c = &lsp_pool[i];
+        if (!c->running) return c;
+        if (c != lsp && (!lru || c->idle_since_ms < lru->idle_since_ms)) lru = c;
+    }
+    if (!lru) return NULL;
+    LspClient *active = lsp;
+    lsp = lru;
+    lsp_shutdown();
+    lsp = active;
+    return lru;
+}
+
+/* The file being opened belongs to the project in the current directory. */
+static void current_root_set(void) {
+    if (!getcwd(current_root, sizeof(current_root))) current_root[0] = '\0';
+}
+
+/* Servers are keyed by language and root, the directory the tab's file was
+   opened from, not wherever the explorer is now. */
+static void lsp_prepare_for_file(const char *file, const char *root, const SyntaxLang *lang) {
+    LspClient *prev = lsp;
+    lsp_leave_document();
+    lsp = &lsp_none;
+    const char *cmd = !lsp_disabled && is_lsp_lang(lang) ? lsp_cmd_for_lang(lang->name) : NULL;
+    LspClient *c = NULL;
+    if (cmd && cmd[0] && root && root[0]) {
+        char root_uri[PATH_MAX * 2];
+        make_file_uri(root, root_uri, sizeof(root_uri));
+        c = lsp_pool_find(lang->name, root_uri);
+        if (!c && (c = lsp_pool_slot()) != NULL) {
+            lsp = c;
+            if (lsp_spawn(cmd, lang->name)) {
+                snprintf(lsp->root_uri, sizeof(lsp->root_uri), "%s", root_uri);
+                lsp_send_initialize();
+            } else {
+                set_status("LSP start failed: %s", cmd);
+                c = NULL;
+            }
+            lsp = &lsp_none;
+        }
+    }
+    if (c != prev) completion_clear();
+    if (!c) return;
+    lsp = c;
+    lsp_enter_document(file, lang);
+}
+
+/* path's tab is closing: servers that have it open close it too. */
+static void lsp_close_document(const char *path) {
+    if (!path || !path[0]) return;
+    char uri[PATH_MAX * 2 + 8];
+    make_file_uri(path, uri, sizeof(uri));
+    LspClient *active = lsp;
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        lsp = &lsp_pool[i];
+        if (!lsp->running) continue;
+        LspDoc *doc = lsp_doc_find(uri);
+        if (!doc) continue;
+        if (doc == lsp->doc) lsp_cancel_completion();
+        if (doc->open)
+            lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didClose\",\"params\":{\"textDocument\":{\"uri\":\"%s\"}}}", uri);
+        lsp_doc_remove(doc);
+    }
+    lsp = active;
+}
+
+/* path is about to be read back into its buffer: servers that have it open
+   get the whole new text the next time it is active. */
+static void lsp_reload_document(const char *path) {
+    if (!path || !path[0]) return;
+    char uri[PATH_MAX * 2 + 8];
+    make_file_uri(path, uri, sizeof(uri));
+    LspClient *active = lsp;
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        LspClient *c = &lsp_pool[i];
+        if (!c->running) continue;
+        lsp = c;
+        LspDoc *doc = lsp_doc_find(uri);
+        if (doc && doc->open) {
+            lsp_doc_changes_clear(doc);
+            doc->change_full = 1;
+            lsp_cache_drop(doc);
+        }
+    }
+    lsp = active;
+}
+
+/* Column x of line y in the server's units: bytes, or UTF-16 code units. */
+static int lsp_character(int y, int x) {
+    if (lsp->utf8_positions) return x;
+    int units = 0;
+    for (int i = 0; i < x && buf[y][i]; i++) {
+        unsigned char b = (unsigned char)buf[y][i];
+        if ((b & 0xc0) == 0x80) continue;
+        units += (b >= 0xf0) ? 2 : 1;
+    }
+    return units;
+}
+
+static void lsp_request_completion(void) {
+    if (!lsp->doc || !lsp->doc->open) return;
+    if (lsp->wq_bytes > LSP_WQ_HIGH) return;   /* the server is behind anyway */
+    lsp_send_did_change();
+    lsp_cancel_completion();   /* superseded */
+    int id = lsp->next_id++;
+    lsp->pending_completion_id = id;
+    lsp->completion_doc = lsp->doc;
+    lsp->completion_version = lsp->doc->version;
+    lsp->completion_line = cy;
+    lsp->completion_col = cx;
+    lsp->completion_start = cx - (int)strlen(lsp_request_prefix);
+    lsp_expect(id, LSP_REQ_COMPLETION, lsp_request_prefix);
+    lsp_send_fmt("{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"textDocument/completion\",\"params\":{\"textDocument\":{\"uri\":\"%s\"},\"position\":{\"line\":%d,\"character\":%d}}}",
+                 id, lsp->doc->uri, cy, lsp_character(cy, cx));
+}
+
+/* Complete the word starting at column start from the last list when that
+   list was for the same word, the word has only grown since, and the
+   server called the list complete. */
+static int lsp_cache_complete(const char *prefix, int start) {
+    const LspDoc *doc = lsp->doc;
+    if (!doc || !doc->cache || doc->cache_incomplete) return 0;
+    if (doc->cache_line != cy || doc->cache_col != start) return 0;
+    if (strncmp(prefix, doc->cache_prefix, strlen(doc->cache_prefix)) != 0) return 0;
+    lsp_cancel_completion();
+    lsp_cache_show(prefix);
+    return 1;
+}
+
+static int get_word_prefix(char *out, size_t out_sz, int *start_out) {
+    if (!buf || cy < 0 || cy >= lines) return 0;
+    int start = cx;
     while (start > 0) {
         char c = buf[cy][start - 1];
         if (isalnum((unsigned char)c) || c == '_') start--;
@@ -1246,12 +2989,13 @@ static void keyword_completion(const SyntaxLang *lang, const char *prefix) {
 
 static void completion_trigger_with_char(const SyntaxLang *lang, int ch) {
     char prefix[MAX_COMPLETION_LABEL];
-    int has_prefix = get_word_prefix(prefix, sizeof(prefix), NULL);
-    if (!has_prefix && is_lsp_lang(lang) && lsp.running && lsp.initialized) {
+    int start = cx;
+    int has_prefix = get_word_prefix(prefix, sizeof(prefix), &start);
+    if (!has_prefix && is_lsp_lang(lang) && lsp->running && lsp->initialized) {
         if (ch == '.' || ch == '>' || ch == ':' ) {
             lsp_request_prefix[0] = '\0';
             completion_from_lsp = 1;
-            lsp_request_completion();
+            if (!lsp_cache_complete("", cx)) lsp_request_completion();
             return;
         }
     }
@@ -1259,11 +3003,11 @@ static void completion_trigger_with_char(const SyntaxLang *lang, int ch) {
         completion_clear();
         return;
     }
-    if (is_lsp_lang(lang) && lsp.running && lsp.initialized) {
+    if (is_lsp_lang(lang) && lsp->running && lsp->initialized) {
         strncpy(lsp_request_prefix, prefix, sizeof(lsp_request_prefix) - 1);
         lsp_request_prefix[sizeof(lsp_request_prefix) - 1] = '\0';
         completion_from_lsp = 1;
-        lsp_request_completion();
+        if (!lsp_cache_complete(prefix, start)) lsp_request_completion();
         return;
     }
     completion_from_lsp = 0;
@@ -1281,12 +3025,13 @@ static void apply_completion(void) {
     int label_len = (int)strlen(label);
     int new_len = line_len - len + label_len;
     if (new_len >= MAX_LINE) return;
+    lsp_record_change(cy, start, cy, start + len, label, (size_t)label_len);
     memmove(&buf[cy][start + label_len], &buf[cy][start + len], (size_t)(line_len - (start + len) + 1));
     memcpy(&buf[cy][start], label, (size_t)label_len);
     cx = start + label_len;
     is_dirty = 1;
     completion_clear();
-    lsp_send_did_change();
+    edit_changed(cy, 1);
 }
 
 static void layout_windows(void) {
@@ -1306,6 +3051,14 @@ static void layout_windows(void) {
     wresize(sidew, content_h, side); mvwin(sidew, 2, side_x);
     wresize(mainw, content_h, w - side); mvwin(mainw, 2, main_x);
     wresize(statusw, 1, w); mvwin(statusw, h - 1, 0);
+    preview_pane_resized();
+    ui_mark(DIRTY_ALL);
+}
+
+/* Popups draw over every pane, so closing one forces a full repaint. */
+static void popup_close(WINDOW *wpopup) {
+    delwin(wpopup);
+    ui_mark(DIRTY_ALL);
 }
 
 static void popup_input(const char *title, const char *label, char *out, size_t out_sz) {
@@ -1325,23 +3078,19 @@ static void popup_input(const char *title, const char *label, char *out, size_t
     mvwgetnstr(wpopup, 5, 4, out, (int)out_sz - 1);
     noecho();
     curs_set(0);
-    delwin(wpopup);
-}
-
-/* ---------- FILE UTILITIES ---------- */
-int is_dir(const char *f) {
-    struct stat st;
-    return stat(f, &st) == 0 && S_ISDIR(st.st_mode);
+    hw_cursor_state = 0;
+    popup_close(wpopup);
 }
 
+/* ---------- FILE UTILITIES ---------- */
 static void delete_selected_file(void) {
     if (file_count <= 0) return;
-    const char *name = files[sel];
+    const char *name = files[sel].name;
     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
         set_status("Cannot delete %s", name);
         return;
     }
-    if (is_dir(name)) {
+    if (files[sel].is_dir) {
         set_status("Delete failed: %s is a directory", name);
         return;
     }
@@ -1355,6 +3104,7 @@ static void delete_selected_file(void) {
         set_status("Deleted: %s", name);
         load_dir();
         if (sel >= file_count && file_count > 0) sel = file_count - 1;
+        preview_selection_changed();
     } else {
         set_status("Delete failed: %s", name);
     }
@@ -1363,18 +3113,36 @@ static void delete_selected_file(void) {
 void load_dir() {
     DIR *d = opendir(".");
     if (!d) { file_count=0; return; }
+    int dfd = dirfd(d);
     struct dirent *e;
     file_count = 0;
     while ((e = readdir(d)) && file_count < MAX_FILES) {
-        strncpy(files[file_count++], e->d_name, sizeof(files[0])-1);
-        files[file_count-1][sizeof(files[0])-1] = '\0';
+        DirEntry *f = &files[file_count++];
+        strncpy(f->name, e->d_name, sizeof(f->name)-1);
+        f->name[sizeof(f->name)-1] = '\0';
+        f->is_dir = 0;
+        if (e->d_type == DT_DIR) {
+            f->is_dir = 1;
+        } else if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) {
+            /* Type unknown or a symlink that may point at a directory. */
+            struct stat st;
+            if (fstatat(dfd, e->d_name, &st, 0) == 0) f->is_dir = S_ISDIR(st.st_mode) ? 1 : 0;
+        }
     }
     closedir(d);
     sel = 0;
     file_off = 0;
+    preview_sel = -1;
+    preview_selection_changed();
+    ui_mark(DIRTY_SIDEBAR | DIRTY_EDITOR);
 }
 
-void load_file(const char *f) {
+void load_file(const char *name) {
+    TRACE_SCOPE("load_file");
+    char f[PATH_MAX];
+    path_canonical(name, f, sizeof(f));
+    edit_batch_flush();
+    lsp_reload_document(f);
     buffer_init_if_needed();
     FILE *fp = fopen(f, "r");
     buffer_clear();
@@ -1397,13 +3165,16 @@ void load_file(const char *f) {
     }
     strncpy(current_file, f, sizeof(current_file)-1);
     current_file[sizeof(current_file)-1]='\0';
+    current_root_set();
     cx=cy=0;
     rowoff=coloff=0;
     is_dirty = 0;
     const SyntaxLang *lang = sh_lang_for_file(current_file);
-    lsp_prepare_for_file(current_file, lang);
+    lsp_prepare_for_file(current_file, current_root, lang);
     state_save();
+    wrap_invalidate();
     syntax_recalc_all();
+    ui_mark(DIRTY_ALL);
 }
 
 void save_file() {
@@ -1422,12 +3193,16 @@ void save_file_as() {
     char fname[256];
     popup_input("Save As", "Enter file name (with extension):", fname, sizeof(fname));
     if(strlen(fname)==0) return;
-    strncpy(current_file,fname,sizeof(current_file)-1);
-    current_file[sizeof(current_file)-1]='\0';
+    char old[PATH_MAX];
+    memcpy(old, current_file, sizeof(old));
+    path_canonical(fname, current_file, sizeof(current_file));
+    /* The server drops the old name; the new one is opened below. */
+    if (old[0] && strcmp(old, current_file) != 0) lsp_close_document(old);
     save_file();
     load_dir();
+    current_root_set();
     const SyntaxLang *lang = sh_lang_for_file(current_file);
-    lsp_prepare_for_file(current_file, lang);
+    lsp_prepare_for_file(current_file, current_root, lang);
     state_save();
     syntax_recalc_all();
     tab_store_current();
@@ -1473,7 +3248,7 @@ void popup(const char *title,const char *msg){
     mvwprintw(wpopup,h-2,2,"Press any key...");
     wrefresh(wpopup);
     wgetch(wpopup);
-    delwin(wpopup);
+    popup_close(wpopup);
 }
 
 int popup_select(const char *title, const char *items[], int count) {
@@ -1498,11 +3273,11 @@ int popup_select(const char *title, const char *items[], int count) {
         wrefresh(wpopup);
         ch = wgetch(wpopup);
         if (ch == 27) { /* ESC */
-            delwin(wpopup);
+            popup_close(wpopup);
             return -1;
         }
         if (ch == '\n') {
-            delwin(wpopup);
+            popup_close(wpopup);
             return sel;
         }
         if (ch == KEY_UP && sel > 0) sel--;
@@ -1521,12 +3296,14 @@ static void settings_dialog(void) {
     int sel = 0;
     int ch;
     while (1) {
-        char item0[64], item1[64], item2[64], item3[64];
+        static const char *blink_names[] = { "Off", "Soft", "Terminal" };
+        char item0[64], item1[64], item2[64], item3[64], item4[64];
         snprintf(item0, sizeof(item0), "Explorer Side: %s", sidebar_on_right ? "Right" : "Left");
         snprintf(item1, sizeof(item1), "Line Numbers: %s", show_line_numbers ? "On" : "Off");
         snprintf(item2, sizeof(item2), "Status Bar: %s", show_status_bar ? "On" : "Off");
         snprintf(item3, sizeof(item3), "Word Wrap: %s", soft_wrap ? "On" : "Off");
-        const char *items[] = { item0, item1, item2, item3, "Close" };
+        snprintf(item4, sizeof(item4), "Cursor Blink: %s", blink_names[cursor_blink]);
+        const char *items[] = { item0, item1, item2, item3, item4, "Close" };
         int count = (int)(sizeof(items) / sizeof(items[0]));
 
         werase(wpopup);
@@ -1549,11 +3326,15 @@ static void settings_dialog(void) {
             else if (sel == 1) show_line_numbers = !show_line_numbers;
             else if (sel == 2) show_status_bar = !show_status_bar;
             else if (sel == 3) soft_wrap = !soft_wrap;
-            else if (sel == 4) break;
+            else if (sel == 4) {
+                cursor_blink = (cursor_blink + 1) % 3;
+                cursor_blink_chosen = 1;
+            }
+            else if (sel == 5) break;
             state_save();
         }
     }
-    delwin(wpopup);
+    popup_close(wpopup);
     set_status("Settings updated");
 }
 
@@ -1563,6 +3344,7 @@ static void shortcuts_dialog(void) {
         "  Ctrl+X        Exit",
         "  Ctrl+S        Save",
         "  F5/F6         Prev/Next tab",
+        "  F12           Latency overlay (p50/p99 per stage)",
         "",
         "Explorer (file list)",
         "  Up/Down       Move selection (Up at top opens menu)",
@@ -1657,12 +3439,13 @@ static void shortcuts_dialog(void) {
         if (sel >= top + list_rows) top = sel - list_rows + 1;
     }
 
-    delwin(wpopup);
+    popup_close(wpopup);
     set_status("Shortcuts closed");
 }
 
 /* ---------- FIND/REPLACE ---------- */
 void find_text() {
+    TRACE_SCOPE("find_text");
     completion_clear();
     char query[256];
     query[0] = '\0';
@@ -1715,8 +3498,10 @@ void replace_text() {
     }
     if (changed) {
         is_dirty = 1;
-        lsp_send_did_change();
+        lsp_record_full();
+        lsp_schedule_did_change();
         syntax_recalc_all();
+        wrap_lines_changed(0, lines - 1);
         state_save();
         set_status("Replaced '%s'", find);
     } else {
@@ -1725,24 +3510,198 @@ void replace_text() {
 }
 
 /* ---------- EDITING ---------- */
-static void editor_scroll(void) {
-    int h, w;
-    getmaxyx(mainw, h, w);
-    int rows = h - 2;
-    int cols = w - 2;
+/* ---------- SOFT WRAP ---------- */
+/* Visual rows per buffer line, summed in a Fenwick tree so mapping between
+   lines and visual rows is O(log n). Edits within a line are point updates.
+   Inserting or removing lines shifts the cached row counts and rebuilds the
+   tree from the edit down, without measuring untouched lines again; only a
+   new width or a different buffer measures every line. A line takes
+   len / width + 1 rows, so the cursor after the last character always has
+   a cell of its own. */
+static int *wrap_tree = NULL;    /* 1-based Fenwick tree over wrap_rows */
+static int *wrap_rows = NULL;
+static int wrap_cap = 0;
+static int wrap_n = 0;           /* lines the index was built for */
+static int wrap_width = 0;
+static int wrap_valid = 0;
+
+static int wrap_rows_for(int len) {
+    return wrap_width > 0 ? len / wrap_width + 1 : 1;
+}
+
+static void wrap_invalidate(void) {
+    wrap_valid = 0;
+}
+
+static void wrap_add(int i, int delta) {
+    for (i++; i <= wrap_n; i += i & -i) wrap_tree[i] += delta;
+}
+
+/* Visual rows taken by lines [0, i). */
+static int wrap_prefix(int i) {
+    int sum = 0;
+    for (; i > 0; i -= i & -i) sum += wrap_tree[i];
+    return sum;
+}
+
+/* Line containing visual row vrow. */
+static int wrap_find(int vrow) {
+    int pos = 0;
+    int step = 1;
+    while (step * 2 <= wrap_n) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= wrap_n && wrap_tree[pos + step] <= vrow) {
+            pos += step;
+            vrow -= wrap_tree[pos];
+        }
+    }
+    return pos < wrap_n ? pos : wrap_n - 1;
+}
+
+static int wrap_reserve(int n) {
+    if (n + 1 <= wrap_cap) return 1;
+    int cap = wrap_cap ? wrap_cap : 256;
+    while (cap < n + 1) cap *= 2;
+    int *tree = realloc(wrap_tree, (size_t)cap * sizeof(int));
+    if (!tree) return 0;
+    wrap_tree = tree;
+    int *rows = realloc(wrap_rows, (size_t)cap * sizeof(int));
+    if (!rows) return 0;
+    wrap_rows = rows;
+    wrap_cap = cap;
+    return 1;
+}
+
+static void wrap_sync(int width) {
+    if (width < 1) width = 1;
+    if (wrap_valid && wrap_n == lines && wrap_width == width) return;
+    if (!wrap_reserve(lines)) return;
+    wrap_width = width;
+    wrap_n = lines;
+    wrap_tree[0] = 0;
+    for (int i = 0; i < lines; i++) {
+        wrap_rows[i] = wrap_rows_for((int)strlen(buf[i]));
+        wrap_tree[i + 1] = wrap_rows[i];
+    }
+    for (int i = 1; i <= lines; i++) {
+        int parent = i + (i & -i);
+        if (parent <= lines) wrap_tree[parent] += wrap_tree[i];
+    }
+    wrap_valid = 1;
+}
+
+/* Recompute tree nodes covering lines from lo on. Nodes at or below lo only
+   cover earlier lines and are kept. */
+static void wrap_rebuild_from(int lo) {
+    for (int i = lo + 1; i <= wrap_n; i++) {
+        int sum = wrap_rows[i - 1];
+        for (int j = 1; j < (i & -i); j *= 2) sum += wrap_tree[i - j];
+        wrap_tree[i] = sum;
+    }
+}
+
+/* Lines [lo, hi] hold new text and the lines after them moved by delta
+   (lines were inserted or removed). hi < lo when no line kept new text. */
+static void wrap_lines_moved(int lo, int hi, int delta) {
+    if (!wrap_valid) return;
+    if (wrap_n + delta != lines || !wrap_reserve(lines)) {
+        wrap_valid = 0;
+        return;
+    }
+    if (lo < 0) lo = 0;
+    if (hi < lo - 1) hi = lo - 1;
+    memmove(&wrap_rows[hi + 1], &wrap_rows[hi + 1 - delta], (size_t)(lines - hi - 1) * sizeof(int));
+    for (int i = lo; i <= hi; i++) wrap_rows[i] = wrap_rows_for((int)strlen(buf[i]));
+    wrap_n = lines;
+    wrap_rebuild_from(lo);
+    if (soft_wrap) ui_mark(DIRTY_EDITOR);
+}
+
+/* Lines [lo, hi] were edited in place. Line count changes go through
+   wrap_lines_moved(); one that did not is caught here and rebuilds. */
+static void wrap_lines_changed(int lo, int hi) {
+    if (!wrap_valid) return;
+    if (wrap_n != lines) {
+        wrap_valid = 0;
+        return;
+    }
+    if (hi >= lines) hi = lines - 1;
+    for (int i = lo < 0 ? 0 : lo; i <= hi; i++) {
+        int rows = wrap_rows_for((int)strlen(buf[i]));
+        if (rows == wrap_rows[i]) continue;
+        wrap_add(i, rows - wrap_rows[i]);
+        wrap_rows[i] = rows;
+        /* Everything below moved by a row. */
+        if (soft_wrap) ui_mark(DIRTY_EDITOR);
+    }
+}
+
+/* Visual row of the cursor, and of the top of the screen. */
+static int wrap_cursor_vrow(void) {
+    return wrap_prefix(cy) + cx / wrap_width;
+}
+
+static int wrap_top_vrow(void) {
+    int sub = rowoff_sub;
+    if (sub >= wrap_rows[rowoff]) sub = wrap_rows[rowoff] - 1;
+    return wrap_prefix(rowoff) + sub;
+}
+
+/* Up/Down in soft wrap mode step over visual rows, keeping the column
+   within the row. */
+static void wrap_move_vertical(int dir) {
+    int w = wrap_width;
+    int col = cx % w;
+    int len = (int)strlen(buf[cy]);
+    if (dir < 0) {
+        if (cx >= w) { cx -= w; return; }
+        if (cy == 0) return;
+        cy--;
+        len = (int)strlen(buf[cy]);
+        cx = (len / w) * w + col;
+    } else {
+        if (cx / w < len / w) { cx += w; }
+        else {
+            if (cy >= lines - 1) return;
+            cy++;
+            len = (int)strlen(buf[cy]);
+            cx = col;
+        }
+    }
+    if (cx > len) cx = len;
+}
+
+static int editor_text_width(void) {
+    int cols = getmaxx(mainw) - 2;
     int ln_digits = num_digits(lines);
     if (ln_digits < 2) ln_digits = 2;
     int ln_width = show_line_numbers ? ln_digits + 1 : 0;
-    int avail = cols - ln_width;
-    if (avail < 4) avail = 4;
-    if (cy < rowoff) rowoff = cy;
-    if (cy >= rowoff + rows) rowoff = cy - rows + 1;
+    return cols - ln_width;
+}
+
+static void editor_scroll(void) {
+    int rows = getmaxy(mainw) - 2;
+    int avail = editor_text_width();
+    if (rowoff >= lines) rowoff = lines - 1;
+    if (rowoff < 0) rowoff = 0;
     if (soft_wrap) {
+        wrap_sync(avail);
+        if (!wrap_valid || rows < 1) return;
+        int cur = wrap_cursor_vrow();
+        int top = wrap_top_vrow();
+        if (cur < top) top = cur;
+        if (cur >= top + rows) top = cur - rows + 1;
+        rowoff = wrap_find(top);
+        rowoff_sub = top - wrap_prefix(rowoff);
         coloff = 0;
-    } else {
-        if (cx < coloff) coloff = cx;
-        if (cx >= coloff + avail) coloff = cx - avail + 1;
+        return;
     }
+    if (avail < 4) avail = 4;
+    rowoff_sub = 0;
+    if (cy < rowoff) rowoff = cy;
+    if (cy >= rowoff + rows) rowoff = cy - rows + 1;
+    if (cx < coloff) coloff = cx;
+    if (cx >= coloff + avail) coloff = cx - avail + 1;
 }
 
 static void explorer_scroll(void) {
@@ -1754,15 +3713,73 @@ static void explorer_scroll(void) {
     if (sel >= file_off + rows) file_off = sel - rows + 1;
 }
 
+/* ---------- EDIT BATCH ---------- */
+/* Keys drained from one read of the terminal are applied as a batch: edits
+   only record which lines changed, and the syntax recalculation runs once
+   when the batch ends. Outside a batch every edit is recalculated
+   immediately. LSP deltas queue up either way and go out on the didChange
+   debounce. */
+static int edit_batch_depth = 0;
+static int edit_batch_lo = INT_MAX, edit_batch_hi = -1;
+static int edit_batch_lines = 0;   /* line count at the last recorded edit */
+
+static void edit_batch_begin(void) {
+    if (edit_batch_depth++ == 0) {
+        edit_batch_lo = INT_MAX;
+        edit_batch_hi = -1;
+        edit_batch_lines = lines;
+    }
+}
+
+static void edit_batch_recalc(void) {
+    if (edit_batch_hi >= edit_batch_lo) {
+        int hi = edit_batch_hi < lines ? edit_batch_hi : lines - 1;
+        syntax_recalc_from(edit_batch_lo, hi - edit_batch_lo + 1);
+    }
+    edit_batch_lo = INT_MAX;
+    edit_batch_hi = -1;
+    edit_batch_lines = lines;
+}
+
+/* Bring syntax state and the server up to date with the batch so far;
+   needed before the buffer is swapped out for another tab or file. */
+static void edit_batch_flush(void) {
+    lsp_send_did_change();
+    edit_batch_recalc();
+}
+
+static void edit_batch_end(void) {
+    if (edit_batch_depth == 0 || --edit_batch_depth > 0) return;
+    lsp_schedule_did_change();
+    edit_batch_recalc();
+}
+
+/* Lines from start_line on changed; at least min_lines need their syntax
+   state recomputed. */
+static void edit_changed(int start_line, int min_lines) {
+    if (edit_batch_depth == 0) {
+        lsp_schedule_did_change();
+        syntax_recalc_from(start_line, min_lines);
+        return;
+    }
+    /* Inserted lines push earlier ranges down; removals are left as an
+       over-estimate. */
+    if (lines > edit_batch_lines && edit_batch_hi >= 0) edit_batch_hi += lines - edit_batch_lines;
+    edit_batch_lines = lines;
+    if (start_line < edit_batch_lo) edit_batch_lo = start_line;
+    if (start_line + min_lines - 1 > edit_batch_hi) edit_batch_hi = start_line + min_lines - 1;
+}
+
 static void insert_char(int c) {
     int len = (int)strlen(buf[cy]);
     if (len >= MAX_LINE - 1) return;
+    char ch = (char)c;
+    lsp_record_change(cy, cx, cy, cx, &ch, 1);
     memmove(&buf[cy][cx + 1], &buf[cy][cx], len - cx + 1);
-    buf[cy][cx] = (char)c;
+    buf[cy][cx] = ch;
     cx++;
     is_dirty = 1;
-    lsp_send_did_change();
-    syntax_recalc_from(cy, 1);
+    edit_changed(cy, 1);
 }
 
 static int is_opening_pair(int c, int *closing_out) {
@@ -1793,13 +3810,14 @@ static int handle_autopair(int c) {
     int len = (int)strlen(buf[cy]);
     if (is_opening_pair(c, &closing) && should_auto_pair(c)) {
         if (len + 2 >= MAX_LINE) return 1;
+        char pair[2] = { (char)c, (char)closing };
+        lsp_record_change(cy, cx, cy, cx, pair, 2);
         memmove(&buf[cy][cx + 2], &buf[cy][cx], len - cx + 1);
         buf[cy][cx] = (char)c;
         buf[cy][cx + 1] = (char)closing;
         cx++;
         is_dirty = 1;
-        lsp_send_did_change();
-        syntax_recalc_from(cy, 1);
+        edit_changed(cy, 1);
         return 1;
     }
     if (is_closing_pair(c)) {
@@ -1815,6 +3833,7 @@ static void insert_newline(void) {
     if (!buffer_ensure_capacity(lines + 1)) return;
     char *right = line_alloc_copy(&buf[cy][cx]);
     if (!right) return;
+    lsp_record_change(cy, cx, cy, cx, "\n", 1);
     buf[cy][cx] = '\0';
     for (int i = lines; i > cy + 1; i--) {
         buf[i] = buf[i - 1];
@@ -1831,21 +3850,86 @@ static void insert_newline(void) {
     cy++;
     cx = 0;
     is_dirty = 1;
-    lsp_send_did_change();
-    syntax_recalc_from(recalc_from, 2);
+    wrap_lines_moved(cy - 1, cy, 1);
+    edit_changed(recalc_from, 2);
+}
+
+/* Insert text at the cursor as a single edit: no autopair, no completion,
+   one syntax recalculation and one LSP update. Lines longer than MAX_LINE
+   lose pasted characters, never the text that was already there; returns
+   how many were dropped. */
+static int insert_text(const char *text, size_t n) {
+    int newlines = 0;
+    for (size_t i = 0; i < n; i++) if (text[i] == '\n') newlines++;
+    if (!buffer_ensure_capacity(lines + newlines)) return 0;
+
+    /* Allocate every new line up front so a failure leaves the buffer as is. */
+    char **fresh = NULL;
+    if (newlines > 0) {
+        fresh = (char **)calloc((size_t)newlines, sizeof(char *));
+        if (!fresh) return 0;
+        for (int i = 0; i < newlines; i++) {
+            fresh[i] = line_alloc_empty();
+            if (!fresh[i]) {
+                while (i-- > 0) free(fresh[i]);
+                free(fresh);
+                return 0;
+            }
+        }
+        memmove(&buf[cy + 1 + newlines], &buf[cy + 1], (size_t)(lines - cy - 1) * sizeof(char *));
+        memmove(&hl_open_comment[cy + 1 + newlines], &hl_open_comment[cy + 1], (size_t)(lines - cy - 1));
+        for (int i = 0; i < newlines; i++) {
+            buf[cy + 1 + i] = fresh[i];
+            hl_open_comment[cy + 1 + i] = 0;
+        }
+        free(fresh);
+        lines += newlines;
+    }
+
+    char tail[MAX_LINE];
+    snprintf(tail, sizeof(tail), "%s", &buf[cy][cx]);
+    int tail_len = (int)strlen(tail);
+    lsp_record_change(cy, cx, cy, cx, text, n);
+    buf[cy][cx] = '\0';
+    int start = cy;
+    int last = cy + newlines;
+    int x = cx;
+    int clipped = 0;
+    for (size_t i = 0; i < n; i++) {
+        /* The last line keeps room for the text that followed the cursor. */
+        int limit = cy == last ? MAX_LINE - 1 - tail_len : MAX_LINE - 1;
+        if (text[i] == '\n') {
+            cy++;
+            x = 0;
+        } else if (x < limit) {
+            buf[cy][x++] = text[i];
+        } else {
+            clipped++;
+        }
+        buf[cy][x] = '\0';
+    }
+    cx = x;
+    memcpy(&buf[cy][x], tail, (size_t)tail_len + 1);
+    /* The server saw the text uncut; resend the document as it really is. */
+    if (clipped) lsp_record_full();
+    is_dirty = 1;
+    if (newlines > 0) wrap_lines_moved(start, cy, newlines);
+    edit_changed(start > 0 ? start - 1 : 0, newlines + 2);
+    return clipped;
 }
 
 static void delete_char(void) {
     if (cx > 0) {
+        lsp_record_change(cy, cx - 1, cy, cx, NULL, 0);
         memmove(&buf[cy][cx - 1], &buf[cy][cx], strlen(buf[cy]) - cx + 1);
         cx--;
         is_dirty = 1;
-        lsp_send_did_change();
-        syntax_recalc_from(cy, 1);
+        edit_changed(cy, 1);
     } else if (cy > 0) {
         int prev_len = (int)strlen(buf[cy - 1]);
         int cur_len = (int)strlen(buf[cy]);
         if (prev_len + cur_len < MAX_LINE - 1) {
+            lsp_record_change(cy - 1, prev_len, cy, 0, NULL, 0);
             strcat(buf[cy - 1], buf[cy]);
             free(buf[cy]);
             for (int i = cy; i < lines - 1; i++) buf[i] = buf[i + 1];
@@ -1858,9 +3942,9 @@ static void delete_char(void) {
             cy--;
             cx = prev_len;
             is_dirty = 1;
-            lsp_send_did_change();
+            wrap_lines_moved(cy, cy, -1);
             int recalc_from = cy > 0 ? (cy - 1) : 0;
-            syntax_recalc_from(recalc_from, 2);
+            edit_changed(recalc_from, 2);
         }
     }
 }
@@ -1868,14 +3952,15 @@ static void delete_char(void) {
 static void delete_forward(void) {
     int len = (int)strlen(buf[cy]);
     if (cx < len) {
+        lsp_record_change(cy, cx, cy, cx + 1, NULL, 0);
         memmove(&buf[cy][cx], &buf[cy][cx + 1], len - cx);
         is_dirty = 1;
-        lsp_send_did_change();
-        syntax_recalc_from(cy, 1);
+        edit_changed(cy, 1);
     } else if (cy < lines - 1) {
         int cur_len = (int)strlen(buf[cy]);
         int next_len = (int)strlen(buf[cy + 1]);
         if (cur_len + next_len < MAX_LINE - 1) {
+            lsp_record_change(cy, cur_len, cy + 1, 0, NULL, 0);
             strcat(buf[cy], buf[cy + 1]);
             free(buf[cy + 1]);
             for (int i = cy + 1; i < lines - 1; i++) buf[i] = buf[i + 1];
@@ -1886,23 +3971,25 @@ static void delete_forward(void) {
             }
             lines--;
             is_dirty = 1;
-            lsp_send_did_change();
+            wrap_lines_moved(cy, cy, -1);
             int recalc_from = cy > 0 ? (cy - 1) : 0;
-            syntax_recalc_from(recalc_from, 2);
+            edit_changed(recalc_from, 2);
         }
     }
 }
 
 static void delete_line(int y) {
     if (lines <= 1) {
+        lsp_record_change(0, 0, 0, (int)strlen(buf[0]), NULL, 0);
         buf[0][0] = '\0';
         cx = 0;
         cy = 0;
         is_dirty = 1;
-        lsp_send_did_change();
-        if (hl_open_comment) hl_open_comment[0] = 0;
+        edit_changed(0, 1);
         return;
     }
+    if (y < lines - 1) lsp_record_change(y, 0, y + 1, 0, NULL, 0);
+    else lsp_record_change(y - 1, (int)strlen(buf[y - 1]), y, (int)strlen(buf[y]), NULL, 0);
     free(buf[y]);
     for (int i = y; i < lines - 1; i++) buf[i] = buf[i + 1];
     buf[lines - 1] = NULL;
@@ -1914,9 +4001,9 @@ static void delete_line(int y) {
     if (cy >= lines) cy = lines - 1;
     if (cx > (int)strlen(buf[cy])) cx = (int)strlen(buf[cy]);
     is_dirty = 1;
-    lsp_send_did_change();
+    wrap_lines_moved(y, y - 1, -1);
     int recalc_from = y > 0 ? (y - 1) : 0;
-    syntax_recalc_from(recalc_from, 2);
+    edit_changed(recalc_from, 2);
 }
 
 static void new_file_prompt(void) {
@@ -2142,11 +4229,7 @@ static void import_theme_prompt(void) {
         current_theme_path[sizeof(current_theme_path) - 1] = '\0';
         state_save();
         set_status("Theme imported: %s", current_theme_path);
-        draw_menu();
-        draw_tabs();
-        draw_sidebar();
-        draw_editor();
-        draw_status(status_msg);
+        ui_mark(DIRTY_ALL);
     } else {
         set_status("Error: Theme file missing colors");
     }
@@ -2160,11 +4243,7 @@ static void theme_menu_prompt(void) {
         current_theme_path[0] = '\0';
         state_save();
         set_status("Theme reset to default");
-        draw_menu();
-        draw_tabs();
-        draw_sidebar();
-        draw_editor();
-        draw_status(status_msg);
+        ui_mark(DIRTY_ALL);
     } else if (sel == 1) {
         import_theme_prompt();
     }
@@ -2266,13 +4345,13 @@ static void special_chars_prompt(void) {
         wrefresh(wpopup);
         int ch = wgetch(wpopup);
         if (ch == 27) { /* ESC */
-            delwin(wpopup);
+            popup_close(wpopup);
             set_status("Special chars canceled");
             return;
         }
         if (ch == '\n') {
             char c = specials[sel];
-            delwin(wpopup);
+            popup_close(wpopup);
             insert_char((unsigned char)c);
             set_status("Inserted: %c", c);
             return;
@@ -2295,7 +4374,7 @@ void draw_menu() {
         wattroff(menuw,A_REVERSE);
         x += (int)strlen(menu_items[i]) + 6;
     }
-    wrefresh(menuw);
+    wnoutrefresh(menuw);
 }
 
 static const char *tab_display_name(const Tab *t, char *out, size_t out_sz, int idx) {
@@ -2336,7 +4415,7 @@ void draw_tabs() {
         }
         x += len + 1;
     }
-    wrefresh(tabw);
+    wnoutrefresh(tabw);
 }
 
 void draw_sidebar() {
@@ -2350,10 +4429,10 @@ void draw_sidebar() {
     for(int i=0;i<max_show && (i + file_off) < file_count;i++){
         int idx = i + file_off;
         if(mode==MODE_EXPLORER && idx==sel) wattron(sidew,A_REVERSE);
-        mvwprintw(sidew,i+1,2,"%s%s",files[idx],is_dir(files[idx])?"/":"");
+        mvwprintw(sidew,i+1,2,"%s%s",files[idx].name,files[idx].is_dir?"/":"");
         wattroff(sidew,A_REVERSE);
     }
-    wrefresh(sidew);
+    wnoutrefresh(sidew);
 }
 
 static int is_binary_data(const unsigned char *buf, size_t n) {
@@ -2367,6 +4446,352 @@ static int is_binary_data(const unsigned char *buf, size_t n) {
     return (bad * 5 > n); /* >20% non-printable */
 }
 
+/* ---------- PREVIEW CACHE ---------- */
+/* Rendered previews of recently selected entries, keyed by absolute path.
+ * Entries are filled and revalidated (size + mtime) by the preview worker;
+ * the UI thread only ever draws from here, so repainting the pane never
+ * touches the filesystem. */
+#define PREVIEW_CACHE_SIZE 8
+#define PREVIEW_MAX_LINES 200
+#define PREVIEW_PROBE_BYTES 1024
+#define PREVIEW_DEBOUNCE_MS 80
+
+enum { PREVIEW_TEXT, PREVIEW_BINARY, PREVIEW_DIR, PREVIEW_ERROR, PREVIEW_UNCHANGED };
+
+typedef struct {
+    char *text;
+    chtype *attrs;   /* highlight attribute per byte of text; NULL for dirs */
+    int len;
+} PreviewLine;
+
+typedef struct {
+    int used;
+    char path[PATH_MAX];
+    off_t size;
+    time_t mtime;
+    unsigned long last_use;
+    int kind;
+    PreviewLine *lines;   /* text lines, or directory entries */
+    int line_count;
+    int truncated;        /* directory listing stopped at its limit */
+    unsigned char bytes[PREVIEW_PROBE_BYTES];
+    size_t nbytes;
+} PreviewEntry;
+
+static PreviewEntry preview_cache[PREVIEW_CACHE_SIZE];
+static unsigned long preview_clock = 0;
+
+/* One outstanding request for the worker.  preview_gen is bumped on every
+ * selection change; the worker polls it while reading and abandons work
+ * that has been superseded. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int started;
+    int stopping;
+    int has_req;
+    char path[PATH_MAX];
+    int known;           /* cache holds path at size/mtime below */
+    off_t size;
+    time_t mtime;
+    int limit;           /* directory entries that fit in the pane */
+    unsigned long gen;
+    PreviewEntry *done;  /* finished result waiting for preview_collect() */
+    unsigned long done_gen;
+} preview_worker = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static unsigned long preview_gen = 0;
+static long long preview_due_ms = 0;   /* debounce deadline, 0 when idle */
+
+static void preview_entry_free(PreviewEntry *pe) {
+    for (int i = 0; i < pe->line_count; i++) {
+        free(pe->lines[i].text);
+        free(pe->lines[i].attrs);
+    }
+    free(pe->lines);
+    pe->lines = NULL;
+    pe->line_count = 0;
+    pe->truncated = 0;
+    pe->nbytes = 0;
+    pe->used = 0;
+}
+
+static int preview_cancelled(unsigned long gen) {
+    return __atomic_load_n(&preview_gen, __ATOMIC_RELAXED) != gen;
+}
+
+/* Read and highlight a file preview.  Touches no curses or editor state.
+ * Returns 0 if the request was superseded part way through. */
+static int preview_load(PreviewEntry *pe, const char *path, unsigned long gen) {
+    TRACE_SCOPE("preview_load");
+    pe->kind = PREVIEW_ERROR;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 1;
+
+    pe->nbytes = fread(pe->bytes, 1, sizeof(pe->bytes), fp);
+    if (is_binary_data(pe->bytes, pe->nbytes)) {
+        pe->kind = PREVIEW_BINARY;
+        fclose(fp);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_SET);
+
+    pe->kind = PREVIEW_TEXT;
+    pe->lines = calloc(PREVIEW_MAX_LINES, sizeof(PreviewLine));
+    if (!pe->lines) { fclose(fp); return 1; }
+
+    const SyntaxLang *lang = sh_lang_for_file(path);
+    int in_block_comment = 0;
+    char line[MAX_LINE];
+    chtype attrs[MAX_LINE];
+    while (pe->line_count < PREVIEW_MAX_LINES && fgets(line, sizeof(line), fp)) {
+        if (preview_cancelled(gen)) {
+            fclose(fp);
+            return 0;
+        }
+        line[strcspn(line, "\n")] = 0;
+        int len = syntax_line_attrs(lang, line, &in_block_comment, attrs, MAX_LINE);
+        PreviewLine *pl = &pe->lines[pe->line_count];
+        pl->text = malloc((size_t)len + 1);
+        pl->attrs = malloc(((size_t)len + 1) * sizeof(chtype));
+        if (!pl->text || !pl->attrs) {
+            free(pl->text);
+            free(pl->attrs);
+            break;
+        }
+        memcpy(pl->text, line, (size_t)len);
+        pl->text[len] = '\0';
+        memcpy(pl->attrs, attrs, (size_t)len * sizeof(chtype));
+        pl->len = len;
+        pe->line_count++;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* List a directory for the preview, stopping after limit entries.  Types
+ * come from d_type; only entries that do not report one (or symlinks) get
+ * an fstatat() relative to the directory's own fd. */
+static int preview_load_dir(PreviewEntry *pe, const char *path, int limit, unsigned long gen) {
+    TRACE_SCOPE("preview_load_dir");
+    pe->kind = PREVIEW_ERROR;
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return 1;
+    DIR *d = fdopendir(dfd);
+    if (!d) { close(dfd); return 1; }
+
+    pe->kind = PREVIEW_DIR;
+    if (limit < 1) limit = 1;
+    pe->lines = calloc((size_t)limit, sizeof(PreviewLine));
+    if (!pe->lines) { closedir(d); return 1; }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (preview_cancelled(gen)) {
+            closedir(d);
+            return 0;
+        }
+        if (pe->line_count >= limit) {
+            pe->truncated = 1;
+            break;
+        }
+        int child_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) {
+            struct stat st;
+            child_dir = fstatat(dfd, e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        size_t len = strlen(e->d_name);
+        PreviewLine *pl = &pe->lines[pe->line_count];
+        pl->text = malloc(len + 2);
+        if (!pl->text) break;
+        memcpy(pl->text, e->d_name, len);
+        if (child_dir) pl->text[len++] = '/';
+        pl->text[len] = '\0';
+        pl->len = (int)len;
+        pe->line_count++;
+    }
+    closedir(d);
+    return 1;
+}
+
+static void *preview_worker_main(void *arg) {
+    (void)arg;
+    trace_thread_name("preview");
+    pthread_mutex_lock(&preview_worker.lock);
+    for (;;) {
+        while (!preview_worker.has_req && !preview_worker.stopping)
+            pthread_cond_wait(&preview_worker.cond, &preview_worker.lock);
+        if (preview_worker.stopping) break;
+        char path[PATH_MAX];
+        memcpy(path, preview_worker.path, sizeof(path));
+        int known = preview_worker.known;
+        off_t size = preview_worker.size;
+        time_t mtime = preview_worker.mtime;
+        int limit = preview_worker.limit;
+        unsigned long gen = preview_worker.gen;
+        preview_worker.has_req = 0;
+        pthread_mutex_unlock(&preview_worker.lock);
+
+        PreviewEntry *pe = calloc(1, sizeof(*pe));
+        if (pe) {
+            memcpy(pe->path, path, sizeof(pe->path));
+            struct stat st;
+            int is_dir = 0;
+            if (stat(path, &st) == 0) {
+                pe->size = st.st_size;
+                pe->mtime = st.st_mtime;
+                is_dir = S_ISDIR(st.st_mode);
+            }
+            if (known && pe->size == size && pe->mtime == mtime) {
+                pe->kind = PREVIEW_UNCHANGED;
+            } else if (!(is_dir ? preview_load_dir(pe, path, limit, gen)
+                                : preview_load(pe, path, gen))) {
+                preview_entry_free(pe);
+                free(pe);
+                pe = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&preview_worker.lock);
+        if (pe) {
+            if (preview_worker.done) {
+                preview_entry_free(preview_worker.done);
+                free(preview_worker.done);
+            }
+            preview_worker.done = pe;
+            preview_worker.done_gen = gen;
+            ui_wakeup();
+        }
+    }
+    pthread_mutex_unlock(&preview_worker.lock);
+    trace_thread_exit();
+    return NULL;
+}
+
+/* Abandon any load in flight and wait for the worker, so nothing runs
+ * behind trace_close() at exit. */
+static void preview_worker_stop(void) {
+    pthread_mutex_lock(&preview_worker.lock);
+    int started = preview_worker.started;
+    preview_worker.stopping = 1;
+    __atomic_add_fetch(&preview_gen, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&preview_worker.cond);
+    pthread_mutex_unlock(&preview_worker.lock);
+    if (!started) return;
+    pthread_join(preview_worker.thread, NULL);
+    preview_worker.started = 0;
+    if (preview_worker.done) {
+        preview_entry_free(preview_worker.done);
+        free(preview_worker.done);
+        preview_worker.done = NULL;
+    }
+}
+
+static PreviewEntry *preview_cache_find(const char *path) {
+    for (int i = 0; i < PREVIEW_CACHE_SIZE; i++) {
+        PreviewEntry *pe = &preview_cache[i];
+        if (pe->used && strcmp(pe->path, path) == 0) return pe;
+    }
+    return NULL;
+}
+
+/* Move a worker result into the cache, replacing the same path or the
+ * least recently used slot. */
+static void preview_cache_install(PreviewEntry *src) {
+    PreviewEntry *slot = preview_cache_find(src->path);
+    for (int i = 0; !slot && i < PREVIEW_CACHE_SIZE; i++)
+        if (!preview_cache[i].used) slot = &preview_cache[i];
+    if (!slot) {
+        slot = &preview_cache[0];
+        for (int i = 1; i < PREVIEW_CACHE_SIZE; i++)
+            if (preview_cache[i].last_use < slot->last_use) slot = &preview_cache[i];
+    }
+    preview_entry_free(slot);
+    *slot = *src;
+    slot->used = 1;
+    slot->last_use = ++preview_clock;
+}
+
+static int preview_selected_path(char *out, size_t out_sz) {
+    if (file_count <= 0 || sel < 0 || sel >= file_count) return 0;
+    int n = snprintf(out, out_sz, "%s/%s", cwd, files[sel].name);
+    return n >= 0 && (size_t)n < out_sz;
+}
+
+/* Directory entries the preview pane can show: two columns of rows. */
+static int preview_dir_limit(void) {
+    int h = getmaxy(mainw);
+    return h > 4 ? (h - 4) * 2 : 1;
+}
+
+/* A directory listing cut short for a smaller pane cannot be reused. */
+static int preview_usable(const PreviewEntry *pe, int limit) {
+    return pe->kind != PREVIEW_DIR || !pe->truncated || pe->line_count >= limit;
+}
+
+/* A new selection cancels any load in flight and (re)arms the debounce;
+ * the worker only sees the entry the user settles on. */
+static void preview_selection_changed(void) {
+    if (sel == preview_sel) return;
+    preview_sel = sel;
+    __atomic_add_fetch(&preview_gen, 1, __ATOMIC_RELAXED);
+    preview_due_ms = now_ms() + PREVIEW_DEBOUNCE_MS;
+}
+
+/* A directory listing cut short for a smaller pane is loaded again. */
+static void preview_pane_resized(void) {
+    char path[PATH_MAX];
+    if (preview_due_ms || !preview_selected_path(path, sizeof(path))) return;
+    PreviewEntry *pe = preview_cache_find(path);
+    if (pe && !preview_usable(pe, preview_dir_limit()))
+        preview_due_ms = now_ms() + PREVIEW_DEBOUNCE_MS;
+}
+
+/* Debounce timer fired: hand the settled selection to the worker. */
+static void preview_request(void) {
+    char path[PATH_MAX];
+    if (!preview_selected_path(path, sizeof(path))) return;
+    int limit = preview_dir_limit();
+    PreviewEntry *cached = preview_cache_find(path);
+    if (cached && !preview_usable(cached, limit)) cached = NULL;
+    /* A failure is shown but never matched: its size/mtime are 0/0 when stat
+     * failed, and chmod leaves mtime alone, so it would never be retried. */
+    if (cached && cached->kind == PREVIEW_ERROR) cached = NULL;
+
+    pthread_mutex_lock(&preview_worker.lock);
+    if (!preview_worker.started && !preview_worker.stopping &&
+        pthread_create(&preview_worker.thread, NULL, preview_worker_main, NULL) == 0)
+        preview_worker.started = 1;
+    memcpy(preview_worker.path, path, sizeof(path));
+    preview_worker.known = cached != NULL;
+    preview_worker.size = cached ? cached->size : 0;
+    preview_worker.mtime = cached ? cached->mtime : 0;
+    preview_worker.limit = limit;
+    preview_worker.gen = __atomic_load_n(&preview_gen, __ATOMIC_RELAXED);
+    preview_worker.has_req = 1;
+    pthread_cond_signal(&preview_worker.cond);
+    pthread_mutex_unlock(&preview_worker.lock);
+}
+
+/* Pick up a finished preview, if any; stale results are dropped. */
+static void preview_collect(void) {
+    pthread_mutex_lock(&preview_worker.lock);
+    PreviewEntry *pe = preview_worker.done;
+    unsigned long gen = preview_worker.done_gen;
+    preview_worker.done = NULL;
+    pthread_mutex_unlock(&preview_worker.lock);
+    if (!pe) return;
+
+    if (gen == __atomic_load_n(&preview_gen, __ATOMIC_RELAXED) && pe->kind != PREVIEW_UNCHANGED) {
+        preview_cache_install(pe);
+        free(pe);
+        if (mode == MODE_EXPLORER) ui_mark(DIRTY_EDITOR);
+        return;
+    }
+    preview_entry_free(pe);
+    free(pe);
+}
+
 static void draw_preview_for_selected(void) {
     werase(mainw);
     wbkgd(mainw, COLOR_PAIR(3));
@@ -2375,219 +4800,154 @@ static void draw_preview_for_selected(void) {
     getmaxyx(mainw, h, w);
     if (file_count <= 0) {
         mvwprintw(mainw, 1, 2, "No files");
-        wrefresh(mainw);
+        wnoutrefresh(mainw);
         return;
     }
 
-    const char *name = files[sel];
-    char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s", name);
-    mvwprintw(mainw, 1, 2, "Preview: %s", path);
-
-    if (is_dir(name)) {
-        DIR *d = opendir(name);
-        if (!d) {
-            mvwprintw(mainw, 3, 2, "Cannot open directory");
-            wrefresh(mainw);
-            return;
-        }
-        int y = 3;
-        int col_w = (w - 4) / 2;
-        int x = 2;
-        struct dirent *e;
-        while ((e = readdir(d)) && y < h - 1) {
-            char entry[NAME_MAX + 4];
-            snprintf(entry, sizeof(entry), "%s%s", e->d_name, is_dir(e->d_name) ? "/" : "");
-            mvwprintw(mainw, y, x, "%.*s", col_w - 1, entry);
-            if (x > 2) { x = 2; y++; }
-            else x += col_w;
-        }
-        closedir(d);
-        wrefresh(mainw);
-        return;
-    }
+    DirEntry *fe = &files[sel];
+    const char *name = fe->name;
+    mvwprintw(mainw, 1, 2, "Preview: %s", name);
 
-    FILE *fp = fopen(name, "r");
-    if (!fp) {
+    char path[PATH_MAX];
+    if (!preview_selected_path(path, sizeof(path))) {
         mvwprintw(mainw, 3, 2, "Cannot open file");
-        wrefresh(mainw);
+        wnoutrefresh(mainw);
         return;
     }
-
-    unsigned char probe[1024];
-    size_t n = fread(probe, 1, sizeof(probe), fp);
-    int binary = is_binary_data(probe, n);
-    fseek(fp, 0, SEEK_SET);
-
-    if (binary) {
+    PreviewEntry *pe = preview_cache_find(path);
+    if (pe) pe->last_use = ++preview_clock;
+
+    if (!pe) {
+        mvwprintw(mainw, 3, 2, "Loading...");
+    } else if (pe->kind == PREVIEW_ERROR) {
+        mvwprintw(mainw, 3, 2, fe->is_dir ? "Cannot open directory" : "Cannot open file");
+    } else if (pe->kind == PREVIEW_DIR) {
+        int col_w = (w - 4) / 2;
+        for (int i = 0; i < pe->line_count; i++) {
+            int y = 3 + i / 2;
+            if (y >= h - 1) break;
+            mvwprintw(mainw, y, 2 + (i % 2) * col_w, "%.*s", col_w - 1, pe->lines[i].text);
+        }
+    } else if (pe->kind == PREVIEW_BINARY) {
         mvwprintw(mainw, 3, 2, "Binary file");
         mvwprintw(mainw, 4, 2, "Bytes:");
         int y = 5;
         int x = 2;
-        for (size_t i = 0; i < n && y < h - 1; i++) {
-            mvwprintw(mainw, y, x, "%02x ", probe[i]);
+        for (size_t i = 0; i < pe->nbytes && y < h - 1; i++) {
+            mvwprintw(mainw, y, x, "%02x ", pe->bytes[i]);
             x += 3;
             if (x > w - 4) { x = 2; y++; }
         }
-        fclose(fp);
-        wrefresh(mainw);
-        return;
-    }
-
-    const SyntaxLang *lang = sh_lang_for_file(name);
-    const char *lc = (lang && lang->line_comment && lang->line_comment[0]) ? lang->line_comment : NULL;
-    const char *bcs = (lang && lang->block_comment_start && lang->block_comment_start[0]) ? lang->block_comment_start : NULL;
-    const char *bce = (lang && lang->block_comment_end && lang->block_comment_end[0]) ? lang->block_comment_end : NULL;
-    int lc_len = lc ? (int)strlen(lc) : 0;
-    int bcs_len = bcs ? (int)strlen(bcs) : 0;
-    int bce_len = bce ? (int)strlen(bce) : 0;
-    int in_block_comment = 0;
-
-    char line[MAX_LINE];
-    int y = 3;
-    while (fgets(line, sizeof(line), fp) && y < h - 1) {
-        line[strcspn(line, "\n")] = 0;
+    } else {
         int avail = w - 4;
         if (avail < 0) avail = 0;
-        int i = 0;
-        int col = 0;
-        char in_string = 0;
-
-        int preproc_start = -1;
-        if (lang_is_c_preproc(lang)) {
-            int j = 0;
-            while (line[j] == ' ' || line[j] == '\t') j++;
-            if (line[j] == '#') preproc_start = j;
-        }
-
-        while (line[i] && col < avail) {
-            if (!in_block_comment && !in_string && preproc_start >= 0 && i >= preproc_start) {
-                wattron(mainw, COLOR_PAIR(9) | A_BOLD);
-                mvwaddnstr(mainw, y, 2 + col, &line[i], avail - col);
-                wattroff(mainw, COLOR_PAIR(9) | A_BOLD);
-                break;
-            }
-            if (line[i] == '\t') {
-                mvwaddch(mainw, y, 2 + col, ' ');
-                i++; col++;
-                continue;
-            }
-
-            if (in_block_comment) {
-                if (bce_len && strncmp(&line[i], bce, (size_t)bce_len) == 0) {
-                    int draw = bce_len;
-                    if (draw > (avail - col)) draw = avail - col;
-                    wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                    mvwaddnstr(mainw, y, 2 + col, &line[i], draw);
-                    wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                    i += draw; col += draw;
-                    if (draw == bce_len) in_block_comment = 0;
-                    continue;
-                }
-                wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                mvwaddch(mainw, y, 2 + col, line[i]);
-                wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                i++; col++;
-                continue;
-            }
-
-            if (in_string) {
-                wattron(mainw, COLOR_PAIR(7));
-                mvwaddch(mainw, y, 2 + col, line[i]);
-                wattroff(mainw, COLOR_PAIR(7));
-                if (line[i] == '\\' && line[i + 1]) {
-                    i++; col++;
-                    if (col < avail) {
-                        wattron(mainw, COLOR_PAIR(7));
-                        mvwaddch(mainw, y, 2 + col, line[i]);
-                        wattroff(mainw, COLOR_PAIR(7));
-                        i++; col++;
-                    }
-                    continue;
-                }
-                if (line[i] == in_string) in_string = 0;
-                i++; col++;
-                continue;
-            }
+        for (int i = 0, y = 3; i < pe->line_count && y < h - 1; i++, y++) {
+            int len = pe->lines[i].len;
+            if (len > avail) len = avail;
+            if (len > 0) draw_attr_runs(mainw, y, 2, pe->lines[i].text, pe->lines[i].attrs, len);
+        }
+    }
+    wnoutrefresh(mainw);
+}
 
-            if (lc_len && strncmp(&line[i], lc, (size_t)lc_len) == 0) {
-                wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                mvwaddnstr(mainw, y, 2 + col, &line[i], avail - col);
-                wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                break;
-            }
+static void draw_editor_row(const SyntaxLang *lang, int y, int filerow, int ln_digits, int ln_width, int avail) {
+    if (show_line_numbers) {
+        mvwprintw(mainw, y + 1, 1, "%*d ", ln_digits, filerow + 1);
+        render_curses_calls++;
+    }
+    const char *line = buf[filerow];
+    chtype attrs[MAX_LINE];
+    int in_block_comment = (hl_open_comment && filerow > 0) ? hl_open_comment[filerow - 1] : 0;
+    /* Highlight from column 0 so horizontally scrolled rows keep their state. */
+    int len = syntax_line_attrs(lang, line, &in_block_comment, attrs, MAX_LINE);
+    int start = coloff;
+    if (start > len) start = len;
+    int n = len - start;
+    if (n > avail) n = avail;
+    if (n > 0) draw_attr_runs(mainw, y + 1, 1 + ln_width, line + start, attrs + start, n);
+}
 
-            if (bcs_len && strncmp(&line[i], bcs, (size_t)bcs_len) == 0) {
-                int draw = bcs_len;
-                if (draw > (avail - col)) draw = avail - col;
-                wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                mvwaddnstr(mainw, y, 2 + col, &line[i], draw);
-                wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                i += draw; col += draw;
-                if (draw == bcs_len) in_block_comment = 1;
-                continue;
-            }
+/* Visual rows of filerow from row sub onwards, starting at screen row y and
+   stopping before max_y. Only the first row carries the line number.
+   Returns the number of screen rows used. */
+static int draw_editor_wrapped_line(const SyntaxLang *lang, int y, int max_y, int filerow, int sub,
+                                    int ln_digits, int ln_width) {
+    const char *line = buf[filerow];
+    chtype attrs[MAX_LINE];
+    int in_block_comment = (hl_open_comment && filerow > 0) ? hl_open_comment[filerow - 1] : 0;
+    int len = syntax_line_attrs(lang, line, &in_block_comment, attrs, MAX_LINE);
+    int used = 0;
+    for (int r = sub; r < wrap_rows[filerow] && y + used < max_y; r++, used++) {
+        if (show_line_numbers && r == 0) {
+            mvwprintw(mainw, y + used + 1, 1, "%*d ", ln_digits, filerow + 1);
+            render_curses_calls++;
+        }
+        int start = r * wrap_width;
+        int n = len - start;
+        if (n > wrap_width) n = wrap_width;
+        if (n > 0) draw_attr_runs(mainw, y + used + 1, 1 + ln_width, line + start, attrs + start, n);
+    }
+    return used;
+}
 
-            if (lang_has_string_delim(lang, line[i])) {
-                in_string = line[i];
-                wattron(mainw, COLOR_PAIR(7));
-                mvwaddch(mainw, y, 2 + col, line[i]);
-                wattroff(mainw, COLOR_PAIR(7));
-                i++; col++;
-                continue;
-            }
+/* Where the cursor cell sits inside mainw. */
+static void editor_cursor_screen(int ln_width, int *screeny, int *screenx) {
+    if (soft_wrap && wrap_valid) {
+        *screeny = wrap_cursor_vrow() - wrap_top_vrow() + 1;
+        *screenx = cx % wrap_width + 1 + ln_width;
+    } else {
+        *screeny = cy - rowoff + 1;
+        *screenx = cx - coloff + 1 + ln_width;
+    }
+}
 
-            if (isdigit((unsigned char)line[i]) ||
-                (line[i] == '.' && isdigit((unsigned char)line[i + 1]))) {
-                int nstart = i;
-                int nlen = 0;
-                while (line[i] &&
-                       (isalnum((unsigned char)line[i]) || line[i] == '.' || line[i] == '_' ||
-                        line[i] == '+' || line[i] == '-')) {
-                    i++;
-                    nlen++;
-                }
-                int draw = nlen;
-                if (draw > (avail - col)) draw = avail - col;
-                wattron(mainw, COLOR_PAIR(8));
-                mvwaddnstr(mainw, y, 2 + col, &line[nstart], draw);
-                wattroff(mainw, COLOR_PAIR(8));
-                col += draw;
-                if (draw < nlen) break;
-                continue;
-            }
+/* The cell under the soft cursor, so a blink can restore it without
+   repainting the row. */
+static int cursor_cell_y = -1, cursor_cell_x = -1;
+static chtype cursor_cell_saved = ' ';
 
-            if (isalpha((unsigned char)line[i]) || line[i] == '_') {
-                int wstart = i;
-                int wlen = 0;
-                while (line[i] && (isalnum((unsigned char)line[i]) || line[i] == '_')) {
-                    i++;
-                    wlen++;
-                }
-                int draw = wlen;
-                if (draw > (avail - col)) draw = avail - col;
-                if (lang && sh_is_keyword(lang, &line[wstart], wlen)) {
-                    wattron(mainw, COLOR_PAIR(4) | A_BOLD);
-                    mvwaddnstr(mainw, y, 2 + col, &line[wstart], draw);
-                    wattroff(mainw, COLOR_PAIR(4) | A_BOLD);
-                } else {
-                    mvwaddnstr(mainw, y, 2 + col, &line[wstart], draw);
-                }
-                col += draw;
-                if (draw < wlen) break;
-                continue;
-            }
+static void draw_editor_cursor_cell(void) {
+    if (cursor_cell_y < 0) return;
+    if (blink_on) {
+        chtype ch = cursor_cell_saved & A_CHARTEXT;
+        if (ch == 0) ch = ' ';
+        wattron(mainw, A_REVERSE | A_BOLD);
+        mvwaddch(mainw, cursor_cell_y, cursor_cell_x, ch);
+        wattroff(mainw, A_REVERSE | A_BOLD);
+    } else {
+        mvwaddch(mainw, cursor_cell_y, cursor_cell_x, cursor_cell_saved);
+    }
+}
 
-            mvwaddch(mainw, y, 2 + col, line[i]);
-            i++; col++;
-        }
-        y++;
+static void draw_editor_cursor(int ln_width) {
+    int h, w;
+    getmaxyx(mainw, h, w);
+    int screeny, screenx;
+    editor_cursor_screen(ln_width, &screeny, &screenx);
+    cursor_cell_y = cursor_cell_x = -1;
+    if (screeny >= 1 && screeny < h - 1 && screenx >= 1 && screenx < w - 1) {
+        cursor_cell_y = screeny;
+        cursor_cell_x = screenx;
+        cursor_cell_saved = mvwinch(mainw, screeny, screenx);
+        if (cursor_blink != CURSOR_BLINK_TERMINAL) draw_editor_cursor_cell();
     }
-    fclose(fp);
-    wrefresh(mainw);
+}
+
+/* Blink tick: flip the one cursor cell and nothing else. */
+static void draw_editor_blink(void) {
+    if (cursor_blink != CURSOR_BLINK_SOFT) return;
+    draw_editor_cursor_cell();
+    wnoutrefresh(mainw);
+}
+
+static int editor_ln_digits(void) {
+    int ln_digits = num_digits(lines);
+    if (ln_digits < 2) ln_digits = 2;
+    return ln_digits;
 }
 
 void draw_editor() {
+    TRACE_SCOPE("draw_editor");
     if (mode == MODE_EXPLORER) {
         draw_preview_for_selected();
         return;
@@ -2599,222 +4959,25 @@ void draw_editor() {
     getmaxyx(mainw, h, w);
     int rows = h - 2;
     int cols = w - 2;
-    int ln_digits = num_digits(lines);
-    if (ln_digits < 2) ln_digits = 2;
+    int ln_digits = editor_ln_digits();
     int ln_width = show_line_numbers ? ln_digits + 1 : 0;
+    int avail = cols - ln_width;
+    if (avail < 0) avail = 0;
     const SyntaxLang *lang = sh_lang_for_file(current_file);
-    for(int y=0; y<rows; y++){
-        int filerow = y + rowoff;
-        if (filerow >= lines) break;
-        if(show_line_numbers) mvwprintw(mainw,y+1,1,"%*d ",ln_digits,filerow+1);
-        int start = coloff;
-        int len = (int)strlen(buf[filerow]);
-        if (start > len) start = len;
-        int avail = cols - ln_width;
-        if (avail < 0) avail = 0;
-        int x = 1 + ln_width;
-        const char *line = buf[filerow];
-        int i = start;
-        int col = 0;
-
-        const char *lc = (lang && lang->line_comment && lang->line_comment[0]) ? lang->line_comment : NULL;
-        const char *bcs = (lang && lang->block_comment_start && lang->block_comment_start[0]) ? lang->block_comment_start : NULL;
-        const char *bce = (lang && lang->block_comment_end && lang->block_comment_end[0]) ? lang->block_comment_end : NULL;
-        int lc_len = lc ? (int)strlen(lc) : 0;
-        int bcs_len = bcs ? (int)strlen(bcs) : 0;
-        int bce_len = bce ? (int)strlen(bce) : 0;
-
-        int in_line_comment = 0;
-        int in_block_comment = 0;
-        char in_string = 0;
-        if (lang && bcs_len && bce_len && hl_open_comment && filerow > 0) {
-            in_block_comment = hl_open_comment[filerow - 1] ? 1 : 0;
-        }
-
-        int preproc_start = -1;
-        if (lang_is_c_preproc(lang)) {
-            int j = 0;
-            while (line[j] == ' ' || line[j] == '\t') j++;
-            if (line[j] == '#') preproc_start = j;
-        }
-
-        /* If horizontally scrolled, advance syntax state up to `start` so colors stay correct. */
-        int scan_i = 0;
-        int scan_block = in_block_comment;
-        char scan_str = 0;
-        while (line[scan_i] && scan_i < start) {
-            if (scan_str) {
-                if (line[scan_i] == '\\' && line[scan_i + 1]) { scan_i += 2; continue; }
-                if (line[scan_i] == scan_str) { scan_str = 0; scan_i++; continue; }
-                scan_i++;
-                continue;
-            }
-            if (scan_block) {
-                if (bce_len && strncmp(&line[scan_i], bce, (size_t)bce_len) == 0) {
-                    scan_block = 0;
-                    scan_i += bce_len;
-                    continue;
-                }
-                scan_i++;
-                continue;
-            }
-            if (lc_len && strncmp(&line[scan_i], lc, (size_t)lc_len) == 0) {
-                in_line_comment = 1;
-                break;
-            }
-            if (bcs_len && strncmp(&line[scan_i], bcs, (size_t)bcs_len) == 0) {
-                scan_block = 1;
-                scan_i += bcs_len;
-                continue;
-            }
-            if (lang_has_string_delim(lang, line[scan_i])) {
-                scan_str = line[scan_i];
-                scan_i++;
-                continue;
-            }
-            scan_i++;
-        }
-        in_block_comment = scan_block;
-        in_string = scan_str;
-
-        if (in_line_comment) {
-            wattron(mainw, COLOR_PAIR(6) | A_DIM);
-            mvwaddnstr(mainw, y+1, x, &line[i], avail);
-            wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-        } else {
-            while (line[i] && col < avail) {
-                if (!in_block_comment && !in_string && preproc_start >= 0 && i >= preproc_start) {
-                    wattron(mainw, COLOR_PAIR(9) | A_BOLD);
-                    mvwaddnstr(mainw, y+1, x + col, &line[i], avail - col);
-                    wattroff(mainw, COLOR_PAIR(9) | A_BOLD);
-                    break;
-                }
-                if (line[i] == '\t') {
-                    mvwaddch(mainw, y+1, x + col, ' ');
-                    i++; col++;
-                    continue;
-                }
-
-                if (in_block_comment) {
-                    if (bce_len && strncmp(&line[i], bce, (size_t)bce_len) == 0) {
-                        int draw = bce_len;
-                        if (draw > (avail - col)) draw = avail - col;
-                        wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                        mvwaddnstr(mainw, y+1, x + col, &line[i], draw);
-                        wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                        i += draw; col += draw;
-                        if (draw == bce_len) in_block_comment = 0;
-                        continue;
-                    }
-                    wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                    mvwaddch(mainw, y+1, x + col, line[i]);
-                    wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                    i++; col++;
-                    continue;
-                }
-
-                if (in_string) {
-                    wattron(mainw, COLOR_PAIR(7));
-                    mvwaddch(mainw, y+1, x + col, line[i]);
-                    wattroff(mainw, COLOR_PAIR(7));
-                    if (line[i] == '\\' && line[i + 1]) {
-                        i++; col++;
-                        if (col < avail) {
-                            wattron(mainw, COLOR_PAIR(7));
-                            mvwaddch(mainw, y+1, x + col, line[i]);
-                            wattroff(mainw, COLOR_PAIR(7));
-                            i++; col++;
-                        }
-                        continue;
-                    }
-                    if (line[i] == in_string) in_string = 0;
-                    i++; col++;
-                    continue;
-                }
-
-                if (lc_len && strncmp(&line[i], lc, (size_t)lc_len) == 0) {
-                    wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                    mvwaddnstr(mainw, y+1, x + col, &line[i], avail - col);
-                    wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                    break;
-                }
-
-                if (bcs_len && strncmp(&line[i], bcs, (size_t)bcs_len) == 0) {
-                    int draw = bcs_len;
-                    if (draw > (avail - col)) draw = avail - col;
-                    wattron(mainw, COLOR_PAIR(6) | A_DIM);
-                    mvwaddnstr(mainw, y+1, x + col, &line[i], draw);
-                    wattroff(mainw, COLOR_PAIR(6) | A_DIM);
-                    i += draw; col += draw;
-                    if (draw == bcs_len) in_block_comment = 1;
-                    continue;
-                }
-
-                if (lang_has_string_delim(lang, line[i])) {
-                    in_string = line[i];
-                    wattron(mainw, COLOR_PAIR(7));
-                    mvwaddch(mainw, y+1, x + col, line[i]);
-                    wattroff(mainw, COLOR_PAIR(7));
-                    i++; col++;
-                    continue;
-                }
-
-                if (isdigit((unsigned char)line[i]) ||
-                    (line[i] == '.' && isdigit((unsigned char)line[i + 1]))) {
-                    int nstart = i;
-                    int nlen = 0;
-                    while (line[i] &&
-                           (isalnum((unsigned char)line[i]) || line[i] == '.' || line[i] == '_' ||
-                            line[i] == '+' || line[i] == '-')) {
-                        i++;
-                        nlen++;
-                    }
-                    int draw = nlen;
-                    if (draw > (avail - col)) draw = avail - col;
-                    wattron(mainw, COLOR_PAIR(8));
-                    mvwaddnstr(mainw, y+1, x + col, &line[nstart], draw);
-                    wattroff(mainw, COLOR_PAIR(8));
-                    col += draw;
-                    if (draw < nlen) break;
-                    continue;
-                }
-
-                if (isalpha((unsigned char)line[i]) || line[i] == '_') {
-                    int wstart = i;
-                    int wlen = 0;
-                    while (line[i] && (isalnum((unsigned char)line[i]) || line[i] == '_')) {
-                        i++;
-                        wlen++;
-                    }
-                    int draw = wlen;
-                    if (draw > (avail - col)) draw = avail - col;
-                    if (lang && sh_is_keyword(lang, &line[wstart], wlen)) {
-                        wattron(mainw, COLOR_PAIR(4) | A_BOLD);
-                        mvwaddnstr(mainw, y+1, x + col, &line[wstart], draw);
-                        wattroff(mainw, COLOR_PAIR(4) | A_BOLD);
-                    } else {
-                        mvwaddnstr(mainw, y+1, x + col, &line[wstart], draw);
-                    }
-                    col += draw;
-                    if (draw < wlen) break;
-                    continue;
-                }
-
-                mvwaddch(mainw, y+1, x + col, line[i]);
-                i++; col++;
-            }
+    if (soft_wrap && wrap_valid) {
+        int y = 0;
+        for (int filerow = rowoff, sub = rowoff_sub; filerow < lines && y < rows; filerow++, sub = 0)
+            y += draw_editor_wrapped_line(lang, y, rows, filerow, sub, ln_digits, ln_width);
+    } else {
+        for(int y=0; y<rows; y++){
+            int filerow = y + rowoff;
+            if (filerow >= lines) break;
+            draw_editor_row(lang, y, filerow, ln_digits, ln_width, avail);
         }
     }
-    int screeny = cy - rowoff + 1;
-    int screenx = cx - coloff + 1 + ln_width;
-    if (blink_on && screeny >= 1 && screeny < h - 1 && screenx >= 1 && screenx < w - 1) {
-        chtype cell = mvwinch(mainw, screeny, screenx);
-        chtype ch = cell & A_CHARTEXT;
-        if (ch == 0) ch = ' ';
-        wattron(mainw, A_REVERSE | A_BOLD);
-        mvwaddch(mainw, screeny, screenx, ch);
-        wattroff(mainw, A_REVERSE | A_BOLD);
-    }
+    draw_editor_cursor(ln_width);
+    int screeny, screenx;
+    editor_cursor_screen(ln_width, &screeny, &screenx);
 
     if (completion_active && completion_count > 0 && mode == MODE_EDITOR) {
         int max_items = completion_count;
@@ -2838,7 +5001,180 @@ void draw_editor() {
             if (i == completion_sel) wattroff(mainw, A_REVERSE);
         }
     }
-    wrefresh(mainw);
+    wnoutrefresh(mainw);
+}
+
+/* Repaint screen rows [y0, y1] of the editor from the current view. */
+static void draw_editor_rows(int y0, int y1) {
+    int h, w;
+    getmaxyx(mainw, h, w);
+    int rows = h - 2;
+    int cols = w - 2;
+    int ln_digits = editor_ln_digits();
+    int ln_width = show_line_numbers ? ln_digits + 1 : 0;
+    int avail = cols - ln_width;
+    if (avail < 0) avail = 0;
+    const SyntaxLang *lang = sh_lang_for_file(current_file);
+    if (y0 < 0) y0 = 0;
+    if (y1 > rows - 1) y1 = rows - 1;
+    for (int y = y0; y <= y1; y++) mvwhline(mainw, y + 1, 1, ' ', cols);
+    if (soft_wrap && wrap_valid) {
+        int top = wrap_top_vrow();
+        for (int y = y0; y <= y1; ) {
+            if (top + y >= wrap_prefix(lines)) break;
+            int filerow = wrap_find(top + y);
+            int sub = top + y - wrap_prefix(filerow);
+            y += draw_editor_wrapped_line(lang, y, y1 + 1, filerow, sub, ln_digits, ln_width);
+        }
+        return;
+    }
+    for (int y = y0; y <= y1; y++) {
+        int filerow = y + rowoff;
+        if (filerow >= lines) break;
+        draw_editor_row(lang, y, filerow, ln_digits, ln_width, avail);
+    }
+}
+
+/* Send terminfo capability cap with up to two parameters, or dflt when
+   the entry lacks it. putp() applies the entry's padding but writes
+   through stdio, not ncurses' screen buffer, so callers fflush(stdout)
+   before ncurses writes again. */
+static void tty_put(const char *cap, long a, long b, const char *dflt) {
+    char *str = tigetstr(cap);
+    if (str && str != (char *)-1) putp(tparm(str, a, b, 0L, 0L, 0L, 0L, 0L, 0L, 0L));
+    else putp(dflt);
+}
+
+/* Have the terminal scroll the text area in place. The pane shares screen
+   lines with the sidebar, which ncurses can only scroll whole, so this sets
+   left/right margins (DECSLRM) around the pane and scrolls inside them,
+   then shifts ncurses' copy of the screen (curscr) the same way.
+   wredrawln() first marks the pane's lines unknown; that also resets the
+   line hashes ncurses' own scroll detection keeps, which would otherwise
+   still describe the unshifted screen. The cells written back are known
+   again, so doupdate() only draws the exposed rows.
+   ncurses has no interface for either step. Checked against ncurses 6.4
+   (20221231), narrow build: curscr cells are plain chtypes there, so
+   mvwinchnstr/mvwaddchnstr copy them whole, and ncurses keeps no scroll
+   region state of its own beyond assuming the full screen between
+   updates, which is what this leaves. A wide build would need the
+   cchar_t variants. */
+static void tty_scroll_editor(int delta) {
+    int by, bx, h, w;
+    getbegyx(mainw, by, bx);
+    getmaxyx(mainw, h, w);
+    int rows = h - 2;
+    int amount = delta > 0 ? delta : -delta;
+    if (rows < 1 || w < 3 || amount >= rows) return;
+    static chtype *saved = NULL;   /* row y of the pane at saved + y * w; row 0 is scratch */
+    static size_t saved_cap = 0;
+    size_t need = (size_t)(rows + 1) * (size_t)w + 1;   /* winchnstr adds a 0 */
+    if (need > saved_cap) {
+        chtype *grown = (chtype *)realloc(saved, need * sizeof(chtype));
+        if (!grown) return;
+        saved = grown;
+        saved_cap = need;
+    }
+    for (int y = 1; y <= rows; y++) mvwinchnstr(curscr, by + y, bx, saved + (size_t)y * w, w);
+
+    /* DECSTBM and DECSLRM home the cursor; resetting both leaves it there.
+       DECLRMM is put back the way the DECRQM reply found it. */
+    char seq[64];
+    snprintf(seq, sizeof(seq), "\033[%d;%dr", by + 2, by + rows + 1);
+    tty_put("csr", by + 1, by + rows, seq);
+    snprintf(seq, sizeof(seq), "\033[?69h\033[%d;%ds", bx + 2, bx + w - 1);
+    tty_put("smglr", bx + 1, bx + w - 2, seq);
+    snprintf(seq, sizeof(seq), "\033[%d%c", amount, delta > 0 ? 'S' : 'T');
+    tty_put(delta > 0 ? "indn" : "rin", amount, 0, seq);
+    if (tty_lrmm_was_set) {
+        snprintf(seq, sizeof(seq), "\033[?69h\033[1;%ds", COLS);
+        tty_put("smglr", 0, COLS - 1, seq);
+    } else {
+        putp("\033[?69l");   /* also clears the margins */
+    }
+    snprintf(seq, sizeof(seq), "\033[1;%dr", LINES);
+    tty_put("csr", 0, LINES - 1, seq);
+    /* ncurses emptied its buffer at the end of the last doupdate(), so
+       this goes out ahead of the frame it is part of. */
+    fflush(stdout);
+    mvcur(-1, -1, 0, 0);
+
+    wredrawln(mainw, 1, rows);
+    for (int y = 1; y <= rows; y++) {
+        int from = y + delta;
+        if (from < 1 || from > rows) continue;   /* exposed: left unknown */
+        chtype *row = saved + (size_t)y * w;
+        memcpy(saved + 1, saved + (size_t)from * w + 1, (size_t)(w - 2) * sizeof(chtype));
+        saved[0] = row[0];
+        saved[w - 1] = row[w - 1];
+        mvwaddchnstr(curscr, by + y, bx, saved, w);
+    }
+}
+
+/* Scroll the text area by delta rows and draw only the rows it exposed.
+   Without left/right margins the terminal still gets every shifted cell
+   rewritten; the saving is then only in highlighting and drawing. */
+static void draw_editor_scroll(int delta) {
+    int h = getmaxy(mainw);
+    int rows = h - 2;
+    wsetscrreg(mainw, 1, h - 2);
+    scrollok(mainw, TRUE);
+    wscrl(mainw, delta);
+    scrollok(mainw, FALSE);
+    box(mainw, 0, 0);
+    if (delta > 0) draw_editor_rows(rows - delta, rows - 1);
+    else draw_editor_rows(0, -delta - 1);
+    if (tty_lr_margins) tty_scroll_editor(delta);
+    wnoutrefresh(mainw);
+}
+
+/* Repaint only the buffer lines in [lo, hi] that are on screen. The caller
+   guarantees the layout (offsets, gutter width, popups) has not changed. */
+static void draw_editor_lines(int lo, int hi) {
+    int h, w;
+    getmaxyx(mainw, h, w);
+    int rows = h - 2;
+    int cols = w - 2;
+    int ln_digits = editor_ln_digits();
+    int ln_width = show_line_numbers ? ln_digits + 1 : 0;
+    int avail = cols - ln_width;
+    if (avail < 0) avail = 0;
+    const SyntaxLang *lang = sh_lang_for_file(current_file);
+    if (soft_wrap && wrap_valid) {
+        int top = wrap_top_vrow();
+        int y = 0;
+        for (int i = lo; i <= hi && i < lines; i++) {
+            y = wrap_prefix(i) - top;
+            if (y >= rows) break;
+            int sub = 0;
+            if (y < 0) {
+                sub = -y;
+                y = 0;
+                if (sub >= wrap_rows[i]) continue;
+            }
+            for (int r = y; r < y + wrap_rows[i] - sub && r < rows; r++) mvwhline(mainw, r + 1, 1, ' ', cols);
+            y += draw_editor_wrapped_line(lang, y, rows, i, sub, ln_digits, ln_width);
+        }
+        /* Rows past the last line, when the range reaches the end. */
+        if (hi >= lines - 1) {
+            for (y = wrap_prefix(lines) - top; y < rows; y++)
+                if (y >= 0) mvwhline(mainw, y + 1, 1, ' ', cols);
+        }
+        if (cy >= lo && cy <= hi) draw_editor_cursor(ln_width);
+        wnoutrefresh(mainw);
+        return;
+    }
+    int y0 = lo - rowoff;
+    int y1 = hi - rowoff;
+    if (y0 < 0) y0 = 0;
+    if (y1 > rows - 1) y1 = rows - 1;
+    for (int y = y0; y <= y1; y++) {
+        mvwhline(mainw, y + 1, 1, ' ', cols);
+        int filerow = y + rowoff;
+        if (filerow < lines) draw_editor_row(lang, y, filerow, ln_digits, ln_width, avail);
+    }
+    if (cy - rowoff >= y0 && cy - rowoff <= y1) draw_editor_cursor(ln_width);
+    wnoutrefresh(mainw);
 }
 
 void draw_status(const char *msg){
@@ -2847,6 +5183,8 @@ void draw_status(const char *msg){
     if(show_status_bar) {
         char info[256];
         const char *name = current_file[0] ? current_file : "[No Name]";
+        const char *base = strrchr(name, '/');
+        if (base && base[1]) name = base + 1;
         long rss_kb = 0, vsz_kb = 0;
         get_mem_usage_cached(&rss_kb, &vsz_kb);
         char rss_buf[32] = "";
@@ -2860,24 +5198,232 @@ void draw_status(const char *msg){
             else snprintf(vsz_buf, sizeof(vsz_buf), "VSZ %.2f MB", (double)vsz_kb / 1024.0);
         }
         if (rss_buf[0] && vsz_buf[0]) {
-            snprintf(info, sizeof(info), "%s  Ln %d/%d  Col %d  Lines %d  %s  %s",
+            snprintf(info, sizeof(info), "%.128s  Ln %d/%d  Col %d  Lines %d  %s  %s",
                      name, cy + 1, lines, cx + 1, lines, rss_buf, vsz_buf);
         } else if (rss_buf[0]) {
-            snprintf(info, sizeof(info), "%s  Ln %d/%d  Col %d  Lines %d  %s",
+            snprintf(info, sizeof(info), "%.128s  Ln %d/%d  Col %d  Lines %d  %s",
                      name, cy + 1, lines, cx + 1, lines, rss_buf);
         } else {
-            snprintf(info, sizeof(info), "%s  Ln %d/%d  Col %d  Lines %d",
+            snprintf(info, sizeof(info), "%.128s  Ln %d/%d  Col %d  Lines %d",
                      name, cy + 1, lines, cx + 1, lines);
         }
         int w = getmaxx(statusw);
-        if (msg && msg[0] && (time(NULL) - status_time) < 5) {
+        if (msg && msg[0] && (time(NULL) - status_time) < STATUS_MSG_SECONDS) {
             mvwprintw(statusw,0,2,"%s",msg);
         }
         int x = w - (int)strlen(info) - 2;
         if (x < 2) x = 2;
         mvwprintw(statusw,0,x,"%s",info);
     }
-    wrefresh(statusw);
+    wnoutrefresh(statusw);
+}
+
+/* F12 overlay in the top right corner of the editor pane. */
+static WINDOW *statsw = NULL;
+
+static void draw_stats_overlay(void) {
+    int oh = STAT_COUNT + 3, ow = 44;
+    int my, mx, mh, mw;
+    getbegyx(mainw, my, mx);
+    getmaxyx(mainw, mh, mw);
+    if (mh < oh + 2 || mw < ow + 2) return;
+    int y = my + 1, x = mx + mw - ow - 1;
+    if (!statsw) statsw = newwin(oh, ow, y, x);
+    else mvwin(statsw, y, x);
+    if (!statsw) return;
+    werase(statsw);
+    wbkgd(statsw, COLOR_PAIR(10));
+    box(statsw, 0, 0);
+    mvwprintw(statsw, 1, 2, "%-12s %8s %8s %8s", "stage (ms)", "p50", "p99", "n");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        long long p50, p99;
+        int n = stats_percentiles(i, &p50, &p99);
+        if (i == STAT_TTY_BYTES)
+            mvwprintw(statsw, i + 2, 2, "%-12s %8lld %8lld %8d", stat_names[i], p50, p99, n);
+        else
+            mvwprintw(statsw, i + 2, 2, "%-12s %8.3f %8.3f %8d", stat_names[i], p50 / 1000.0, p99 / 1000.0, n);
+    }
+    touchwin(statsw);
+    wnoutrefresh(statsw);
+}
+
+static void stats_toggle_overlay(void) {
+    stats_overlay = !stats_overlay;
+    if (!stats_overlay && statsw) {
+        delwin(statsw);
+        statsw = NULL;
+    }
+    ui_mark(DIRTY_ALL);
+}
+
+/* Scalar view state from the last frame. Navigation that only changes these
+   (cursor moves, selection, mode switches) is detected here instead of at
+   every call site. */
+typedef struct {
+    enum Mode mode;
+    int menu_sel;
+    int tab_sel, tab_current, tab_count, is_dirty;
+    int sel, file_off, file_count;
+    int cx, cy, rowoff, rowoff_sub, coloff, lines;
+    int top_vrow;   /* first visual row on screen (rowoff without wrap) */
+    int completion_active, completion_sel, completion_count;
+    int show_line_numbers, show_status_bar, soft_wrap;
+    int status_visible;
+    long rss_kb, vsz_kb;
+    char current_file[PATH_MAX];
+} UiView;
+
+static UiView ui_last_view;
+
+static void ui_track_view(void) {
+    UiView v;
+    memset(&v, 0, sizeof(v));
+    v.mode = mode;
+    v.menu_sel = menu_sel;
+    v.tab_sel = tab_sel;
+    v.tab_current = tab_current;
+    v.tab_count = tab_count;
+    v.is_dirty = is_dirty;
+    v.sel = sel;
+    v.file_off = file_off;
+    v.file_count = file_count;
+    v.cx = cx;
+    v.cy = cy;
+    v.rowoff = rowoff;
+    v.rowoff_sub = rowoff_sub;
+    v.top_vrow = (soft_wrap && wrap_valid) ? wrap_top_vrow() : rowoff;
+    v.coloff = coloff;
+    v.lines = lines;
+    v.completion_active = completion_active;
+    v.completion_sel = completion_sel;
+    v.completion_count = completion_count;
+    v.show_line_numbers = show_line_numbers;
+    v.show_status_bar = show_status_bar;
+    v.soft_wrap = soft_wrap;
+    v.status_visible = status_msg[0] && (time(NULL) - status_time) < STATUS_MSG_SECONDS;
+    if (show_status_bar) get_mem_usage_cached(&v.rss_kb, &v.vsz_kb);
+    memcpy(v.current_file, current_file, sizeof(v.current_file));
+
+    const UiView *o = &ui_last_view;
+    if (v.mode != o->mode || strcmp(v.current_file, o->current_file) != 0 ||
+        v.tab_current != o->tab_current) {
+        ui_mark(DIRTY_ALL);
+    }
+    if (v.menu_sel != o->menu_sel) ui_mark(DIRTY_MENU);
+    if (v.tab_sel != o->tab_sel || v.tab_count != o->tab_count || v.is_dirty != o->is_dirty) {
+        ui_mark(DIRTY_TABS);
+    }
+    if (v.sel != o->sel || v.file_count != o->file_count) {
+        ui_mark(DIRTY_SIDEBAR);
+        if (mode == MODE_EXPLORER) ui_mark(DIRTY_EDITOR);
+    }
+    if (v.file_off != o->file_off) ui_mark(DIRTY_SIDEBAR);
+    if (v.rowoff != o->rowoff || v.rowoff_sub != o->rowoff_sub) {
+        /* A pure vertical scroll shifts the rows already drawn. */
+        int delta = v.top_vrow - o->top_vrow;
+        int rows = getmaxy(mainw) - 2;
+        if (v.mode != MODE_EXPLORER && v.mode == o->mode && v.soft_wrap == o->soft_wrap &&
+            delta != 0 && abs(delta) < rows) {
+            ui_scroll_rows += delta;
+            ui_mark_lines(v.cy, v.cy);
+        } else {
+            ui_mark(DIRTY_EDITOR);
+        }
+    }
+    if (v.coloff != o->coloff ||
+        v.completion_active != o->completion_active ||
+        v.completion_sel != o->completion_sel ||
+        v.completion_count != o->completion_count ||
+        v.show_line_numbers != o->show_line_numbers || v.soft_wrap != o->soft_wrap ||
+        num_digits(v.lines) != num_digits(o->lines)) {
+        ui_mark(DIRTY_EDITOR);
+    }
+    if (v.cx != o->cx || v.cy != o->cy) {
+        ui_mark_lines(o->cy, o->cy);
+        ui_mark_lines(v.cy, v.cy);
+        ui_mark(DIRTY_STATUS);
+    }
+    if (v.lines != o->lines) {
+        /* Lines were inserted or removed: everything below shifts. */
+        int from = o->cy < v.cy ? o->cy : v.cy;
+        ui_mark_lines(from > 0 ? from - 1 : 0, INT_MAX);
+        ui_mark(DIRTY_STATUS);
+    }
+    if (v.show_status_bar != o->show_status_bar || v.status_visible != o->status_visible ||
+        v.rss_kb != o->rss_kb || v.vsz_kb != o->vsz_kb) {
+        ui_mark(DIRTY_STATUS);
+    }
+    ui_last_view = v;
+}
+
+static int cursor_visible(void) {
+    return mode != MODE_EXPLORER;
+}
+
+static int decscusr_active = 0;
+
+/* In terminal blink mode the hardware cursor sits on the cursor cell, so
+   mainw has to be the last window refreshed before doupdate(). */
+static void cursor_sync_hw(void) {
+    int terminal = (cursor_blink == CURSOR_BLINK_TERMINAL);
+    if (terminal != decscusr_active) {
+        /* DECSCUSR: 1 = blinking block, 0 = terminal default. */
+        fputs(terminal ? "\033[1 q" : "\033[0 q", stdout);
+        fflush(stdout);
+        decscusr_active = terminal;
+    }
+    int want = (terminal && cursor_visible() && cursor_cell_y >= 0) ? 1 : 0;
+    if (want != hw_cursor_state) {
+        curs_set(want);
+        hw_cursor_state = want;
+    }
+    if (want) {
+        wmove(mainw, cursor_cell_y, cursor_cell_x);
+        wnoutrefresh(mainw);
+    }
+}
+
+/* Repaint whatever is dirty and push it to the terminal with one doupdate(). */
+static void render_frame(void) {
+    editor_scroll();
+    explorer_scroll();
+    ui_track_view();
+    int lines_dirty = ui_dirty_line_hi >= ui_dirty_line_lo;
+    if (!ui_dirty && !lines_dirty && !ui_scroll_rows) return;
+    /* The completion popup overlaps arbitrary rows; repaint around it in full. */
+    if (lines_dirty && completion_active) ui_mark(DIRTY_EDITOR);
+    long long t0 = stats_now_us();
+    /* Counted from here: some output (margin scrolls, DECSCUSR) bypasses
+       doupdate(). */
+    int count_bytes = stats_overlay || stats_dump_path[0];
+    long long wchar0 = count_bytes ? stats_wchar() : -1;
+
+    /* A full repaint follows a resize or popup; keep stdscr from being
+       re-flushed over the panes by the next getch(). */
+    if ((ui_dirty & DIRTY_ALL) == DIRTY_ALL) wnoutrefresh(stdscr);
+    if (ui_dirty & DIRTY_MENU) draw_menu();
+    if (ui_dirty & DIRTY_TABS) draw_tabs();
+    if (ui_dirty & DIRTY_SIDEBAR) draw_sidebar();
+    if (ui_scroll_rows && completion_active) ui_mark(DIRTY_EDITOR);
+    if (ui_scroll_rows && !(ui_dirty & DIRTY_EDITOR)) draw_editor_scroll(ui_scroll_rows);
+    if (ui_dirty & DIRTY_EDITOR) draw_editor();
+    else if (lines_dirty && mode != MODE_EXPLORER) draw_editor_lines(ui_dirty_line_lo, ui_dirty_line_hi);
+    if ((ui_dirty & DIRTY_CURSOR) && !(ui_dirty & DIRTY_EDITOR) && mode != MODE_EXPLORER) {
+        draw_editor_blink();
+    }
+    if (ui_dirty & DIRTY_STATUS) draw_status(status_msg);
+    if (stats_overlay) draw_stats_overlay();
+    cursor_sync_hw();
+    long long t1 = stats_now_us();
+    doupdate();
+    stats_record(STAT_DRAW, t1 - t0);
+    stats_record(STAT_FLUSH, stats_now_us() - t1);
+    if (wchar0 >= 0) stats_record(STAT_TTY_BYTES, stats_wchar() - wchar0);
+
+    ui_dirty = 0;
+    ui_dirty_line_lo = INT_MAX;
+    ui_dirty_line_hi = -1;
+    ui_scroll_rows = 0;
 }
 
 static int confirm_discard_or_save(void) __attribute__((unused));
@@ -2893,12 +5439,443 @@ static int confirm_discard_or_save(void) {
     return 0;
 }
 
+/* ---------- EVENT LOOP ---------- */
+/* The main loop sleeps in poll() on stdin, the LSP pipe and a wakeup pipe
+   for worker threads. Timers (cursor blink, status expiry) only shorten the
+   poll timeout while they are actually needed, so an idle editor in the
+   explorer never wakes up. */
+static int wake_pipe[2] = { -1, -1 };
+static long long blink_due_ms = 0;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+/* Interrupt event_wait(); async-signal-safe and callable from any thread. */
+static void ui_wakeup(void) {
+    if (wake_pipe[1] < 0) return;
+    char c = 1;
+    ssize_t r = write(wake_pipe[1], &c, 1);
+    (void)r;
+}
+
+static void event_init(void) {
+    if (pipe(wake_pipe) != 0) {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        int flags = fcntl(wake_pipe[i], F_GETFL, 0);
+        fcntl(wake_pipe[i], F_SETFL, flags | O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    blink_due_ms = now_ms() + BLINK_INTERVAL_MS;
+}
+
+/* Milliseconds until the next timer is due, or -1 to sleep until input. */
+static int event_next_timeout(void) {
+    long long now = now_ms();
+    long long due = -1;
+    if (cursor_visible() && cursor_blink == CURSOR_BLINK_SOFT) due = blink_due_ms;
+    if (preview_due_ms && (due < 0 || preview_due_ms < due)) due = preview_due_ms;
+    if (lsp->change_due_ms && (due < 0 || lsp->change_due_ms < due)) due = lsp->change_due_ms;
+    long long reap = lsp_reap_due_ms();
+    if (reap && (due < 0 || reap < due)) due = reap;
+    time_t wall = time(NULL);
+    if (status_msg[0] && wall - status_time < STATUS_MSG_SECONDS) {
+        long long left = (long long)(status_time + STATUS_MSG_SECONDS - wall) * 1000LL;
+        if (due < 0 || now + left < due) due = now + left;
+    }
+    if (due < 0) return -1;
+    if (due <= now) return 0;
+    return (int)(due - now);
+}
+
+static void event_wait(void) {
+    struct pollfd fds[2 + LSP_MAX_SERVERS];
+    int nfds = 0;
+    fds[nfds].fd = STDIN_FILENO;
+    fds[nfds].events = POLLIN;
+    nfds++;
+    int wake_idx = -1;
+    if (wake_pipe[0] >= 0) {
+        wake_idx = nfds;
+        fds[nfds].fd = wake_pipe[0];
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    for (int i = 0; i < LSP_MAX_SERVERS; i++) {
+        if (!lsp_pool[i].running || !lsp_pool[i].wq_head) continue;
+        fds[nfds].fd = lsp_pool[i].in_fd;
+        fds[nfds].events = POLLOUT;
+        nfds++;
+    }
+    int rc = poll(fds, (nfds_t)nfds, event_next_timeout());
+    if (rc > 0 && wake_idx >= 0 && (fds[wake_idx].revents & POLLIN)) {
+        char drain[64];
+        while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+    }
+}
+
+static void event_run_timers(void) {
+    long long now = now_ms();
+    if (preview_due_ms && now >= preview_due_ms) {
+        preview_due_ms = 0;
+        preview_request();
+    }
+    if (lsp->change_due_ms && now >= lsp->change_due_ms) {
+        if (lsp->wq_head) lsp->change_due_ms = 0;   /* rearmed once the queue drains */
+        else lsp_send_did_change();
+    }
+    if (!cursor_visible()) {
+        blink_due_ms = now + BLINK_INTERVAL_MS;
+        return;
+    }
+    if (cursor_blink != CURSOR_BLINK_SOFT) {
+        blink_on = 1;
+        return;
+    }
+    if (now >= blink_due_ms) {
+        blink_on = !blink_on;
+        blink_due_ms = now + BLINK_INTERVAL_MS;
+        ui_mark(DIRTY_CURSOR);
+    }
+}
+
+/* ---------- BRACKETED PASTE ---------- */
+/* With ESC[?2004h the terminal wraps pasted text in ESC[200~ ... ESC[201~.
+   The payload is collected whole and inserted by insert_text() instead of
+   being replayed through the key handler one byte at a time. */
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END   (KEY_MAX + 2)
+#define PASTE_IDLE_MS 1000
+
+static void paste_enable(void) {
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    printf("\033[?2004h");
+    fflush(stdout);
+}
+
+/* ---------- TERMINAL MARGINS ---------- */
+/* Ask with DECRQM whether the terminal knows left/right margins (mode 69).
+   The reply comes back through the input like a key; until a positive one
+   arrives, scrolling goes through ncurses as before. Sent before the first
+   frame, so a terminal that prints the query instead gets it cleared. */
+#define KEY_LRMM_SET   (KEY_MAX + 3)
+#define KEY_LRMM_NO    (KEY_MAX + 4)
+#define KEY_LRMM_RESET (KEY_MAX + 5)
+
+static void tty_query_margins(void) {
+    define_key("\033[?69;1$y", KEY_LRMM_SET);    /* set */
+    define_key("\033[?69;2$y", KEY_LRMM_RESET);  /* reset */
+    define_key("\033[?69;3$y", KEY_LRMM_SET);    /* permanently set */
+    define_key("\033[?69;0$y", KEY_LRMM_NO);     /* not recognized */
+    define_key("\033[?69;4$y", KEY_LRMM_NO);     /* permanently reset */
+    printf("\033[?69$p");
+    fflush(stdout);
+}
+
+/* Read up to the end marker. CR and CRLF become LF; other control
+   characters except tab are dropped. Gives up if the terminal goes quiet. */
+static char *paste_read(size_t *len_out) {
+    size_t cap = 4096, len = 0;
+    char *text = (char *)malloc(cap);
+    if (!text) return NULL;
+    int prev_cr = 0;
+    for (;;) {
+        int ch = getch();
+        if (ch == ERR) {
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            if (poll(&pfd, 1, PASTE_IDLE_MS) <= 0) break;
+            continue;
+        }
+        if (ch == KEY_PASTE_END) break;
+        if (ch > 255) continue;
+        if (ch == '\n' && prev_cr) { prev_cr = 0; continue; }
+        prev_cr = ch == '\r';
+        if (ch == '\r') ch = '\n';
+        if (ch < 32 && ch != '\n' && ch != '\t') continue;
+        if (len + 1 >= cap) {
+            char *grown = (char *)realloc(text, cap * 2);
+            if (!grown) break;
+            text = grown;
+            cap *= 2;
+        }
+        text[len++] = (char)ch;
+    }
+    *len_out = len;
+    return text;
+}
+
+static void paste_from_terminal(void) {
+    size_t len = 0;
+    char *text = paste_read(&len);
+    if (!text) return;
+    if (mode == MODE_EDITOR && len > 0) {
+        completion_clear();
+        int dropped = insert_text(text, len);
+        if (dropped)
+            set_status("Pasted %zu bytes, %d dropped (line limit %d)", len, dropped, MAX_LINE - 1);
+        else
+            set_status("Pasted %zu bytes", len);
+    }
+    free(text);
+}
+
+/* ---------- INPUT ---------- */
+/* Apply one key. Returns 1 when the editor should exit. */
+static int handle_key(int ch) {
+    if(ch==KEY_RESIZE) { layout_windows(); return 0; }
+    if(ch==24){ return confirm_exit_all(); } // Ctrl+X
+    if(ch==19){ save_file(); }
+    if(ch==23){ set_status("Word wrap %s", soft_wrap ? "off" : "on"); soft_wrap=!soft_wrap; }
+    if(ch==KEY_PASTE_BEGIN){ paste_from_terminal(); return 0; }
+    if(ch==KEY_PASTE_END) return 0;
+    if(ch==KEY_LRMM_SET || ch==KEY_LRMM_RESET || ch==KEY_LRMM_NO){
+        tty_lr_margins = (ch!=KEY_LRMM_NO);
+        tty_lrmm_was_set = (ch==KEY_LRMM_SET);
+        return 0;
+    }
+    if(ch==KEY_F(12)){ stats_toggle_overlay(); return 0; }
+    if(ch==KEY_F(5)){ tab_prev(); return 0; }
+    if(ch==KEY_F(6)){ tab_next(); return 0; }
+
+    /* ---------- EXPLORER ---------- */
+    if(mode==MODE_EXPLORER){
+        if(ch==KEY_UP && sel==0) { mode=MODE_TABS; tab_sel = tab_current; }
+        else if(ch==KEY_UP && sel>0) { sel--; preview_selection_changed(); }
+        else if(ch==KEY_DOWN && sel<file_count-1) { sel++; preview_selection_changed(); }
+        else if(ch=='\n'){
+            if(files[sel].is_dir){
+                if(chdir(files[sel].name)==0){ if(!getcwd(cwd,sizeof(cwd))) cwd[0]='\0'; load_dir(); }
+            }else{
+                tab_open_file(files[sel].name);
+                mode=MODE_EDITOR;
+            }
+        }else if(ch==KEY_BACKSPACE||ch==127){
+            if(chdir("..")==0){ if(!getcwd(cwd,sizeof(cwd))) cwd[0]='\0'; load_dir(); }
+        }
+        else if(ch==KEY_DC || ch==4){
+            delete_selected_file();
+        }
+    }
+
+    /* ---------- MENU ---------- */
+    else if(mode==MODE_MENU){
+        if(ch==KEY_LEFT && menu_sel>0) menu_sel--;
+        else if(ch==KEY_RIGHT && menu_sel<MENU_ITEMS-1) menu_sel++;
+        else if(ch==KEY_DOWN) { mode=MODE_TABS; tab_sel = tab_current; }
+        else if(ch=='\n'){
+            switch(menu_sel){
+                case 0: { /* Edit */
+                    const char *edit_items[] = {
+                        "Delete Line",
+                        "Paste",
+                        "Special Chars",
+                        "Replace",
+                        "Find"
+                    };
+                    int sel = popup_select("Edit", edit_items, 5);
+                    if (sel == 0) delete_line(cy);
+                    else if (sel == 1) { /* paste */
+                        int len=(int)strlen(clip);
+                        int cur=(int)strlen(buf[cy]);
+                        if (cur + len >= MAX_LINE) len = MAX_LINE - cur - 1;
+                        if (len > 0) {
+                            lsp_record_change(cy, cx, cy, cx, clip, (size_t)len);
+                            memmove(&buf[cy][cx+len],&buf[cy][cx],cur-cx+1);
+                            memcpy(&buf[cy][cx],clip,len); cx+=len;
+                            is_dirty = 1;
+                            edit_changed(cy, 1);
+                        }
+                    }
+                    else if (sel == 2) special_chars_prompt();
+                    else if (sel == 3) replace_text();
+                    else if (sel == 4) find_text();
+                    break;
+                }
+                case 1: /* View */
+                    soft_wrap=!soft_wrap;
+                    show_line_numbers=!show_line_numbers;
+                    set_status("Wrap %s, Line numbers %s", soft_wrap?"on":"off", show_line_numbers?"on":"off");
+                    state_save();
+                    popup("View","Theme: Soft Gray (active)\nFont: Use terminal settings");
+                    break;
+                case 2: settings_dialog(); break;
+                case 3: find_text(); break;
+                case 4: shortcuts_dialog(); break;
+                case 5: { /* File */
+                    const char *file_items[] = { "New", "Save", "Save As" };
+                    int sel = popup_select("File", file_items, 3);
+                    if (sel == 0) new_file_prompt();
+                    else if (sel == 1) save_file();
+                    else if (sel == 2) save_file_as();
+                    break;
+                }
+                case 6: open_external_terminal(); break;
+                case 7: save_file(); break;
+                case 8: save_file_as(); break;
+                case 9: open_folder_prompt(); break;
+                case 10: theme_menu_prompt(); break;
+                case 11: popup("About","Open-source code editor TASCI\nCode editor made by tasic928"); break;
+            }
+        }
+        else if(ch==27) mode=MODE_EXPLORER;
+    }
+
+    /* ---------- TABS ---------- */
+    else if(mode==MODE_TABS){
+        if(ch==KEY_LEFT && tab_sel>0){ tab_sel--; tab_switch(tab_sel); }
+        else if(ch==KEY_RIGHT && tab_sel<tab_count-1){ tab_sel++; tab_switch(tab_sel); }
+        else if(ch=='\n'){ tab_switch(tab_sel); mode=MODE_EDITOR; }
+        else if(ch==KEY_DOWN){ mode=MODE_EXPLORER; }
+        else if(ch==KEY_UP){ mode=MODE_MENU; }
+        else if(ch=='x' || ch=='X' || ch==KEY_DC || ch==4){
+            tab_close(tab_sel);
+            if (tab_sel >= tab_count) tab_sel = tab_count - 1;
+        }
+        else if(ch==27) mode=MODE_EXPLORER;
+    }
+
+    /* ---------- EDITOR ---------- */
+    else if(mode==MODE_EDITOR){
+        const SyntaxLang *lang = sh_lang_for_file(current_file);
+        if (completion_active) {
+            if (ch == KEY_UP && completion_sel > 0) { completion_sel--; return 0; }
+            if (ch == KEY_DOWN && completion_sel < completion_count - 1) { completion_sel++; return 0; }
+            if (ch == '\n' || ch == '\t') { apply_completion(); return 0; }
+            if (ch == 27) { completion_clear(); return 0; }
+        }
+        if(ch==27) { completion_clear(); mode=MODE_EXPLORER; }
+        else if((ch==KEY_UP || ch==KEY_DOWN) && soft_wrap && wrap_valid){ completion_clear(); wrap_move_vertical(ch==KEY_UP ? -1 : 1); }
+        else if(ch==KEY_UP && cy>0){ completion_clear(); cy--; if(cx>(int)strlen(buf[cy])) cx=strlen(buf[cy]); }
+        else if(ch==KEY_DOWN && cy<lines-1){ completion_clear(); cy++; if(cx>(int)strlen(buf[cy])) cx=strlen(buf[cy]); }
+        else if(ch==KEY_LEFT && cx>0){ completion_clear(); cx--; }
+        else if(ch==KEY_RIGHT && cx<(int)strlen(buf[cy])){ completion_clear(); cx++; }
+        else if(ch==KEY_BACKSPACE||ch==127||ch==8){ completion_clear(); delete_char(); }
+        else if(ch==KEY_DC){ completion_clear(); delete_forward(); }
+        else if(ch=='\n'){ completion_clear(); insert_newline(); }
+        else if(isprint(ch)){
+            if (!handle_autopair(ch)) insert_char(ch);
+            completion_trigger_with_char(lang, ch);
+        }
+        else if(ch==0){ completion_trigger_with_char(lang, ' '); }
+        else if(ch==11){ /* Ctrl+K cut */
+            strncpy(clip,buf[cy],MAX_LINE-1);
+            clip[MAX_LINE-1] = '\0';
+            delete_line(cy);
+        }
+        else if(ch==21){ /* Ctrl+U paste */
+            int len=(int)strlen(clip);
+            int cur=(int)strlen(buf[cy]);
+            if (cur + len >= MAX_LINE) len = MAX_LINE - cur - 1;
+            if (len > 0) {
+                lsp_record_change(cy, cx, cy, cx, clip, (size_t)len);
+                memmove(&buf[cy][cx+len],&buf[cy][cx],cur-cx+1);
+                memcpy(&buf[cy][cx],clip,len); cx+=len;
+                is_dirty = 1;
+                edit_changed(cy, 1);
+            }
+        }
+        else if(ch==6) find_text();
+        else if(ch==18) replace_text(); /* Ctrl+R */
+        else if(ch==1){ /* Ctrl+A */
+            cx = 0; cy = 0;
+        }
+    }
+    return 0;
+}
+
+/* ---------- BENCH ---------- */
+/* tasci --bench-render FILE: render every scroll position of FILE into an
+   off-screen terminal and report ncurses calls and time per editor frame. */
+static int bench_render(const char *path) {
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    if (!out || !in) return 1;
+    const char *term = getenv("TERM");
+    SCREEN *scr = newterm((term && term[0]) ? NULL : "xterm-256color", out, in);
+    if (!scr) {
+        fprintf(stderr, "bench-render: cannot initialize terminal\n");
+        return 1;
+    }
+    resizeterm(50, 160);
+    start_color();
+    use_default_colors();
+    apply_theme_pairs();
+    menuw = newwin(1, COLS, 0, 0);
+    tabw = newwin(1, COLS, 1, 0);
+    sidew = newwin(LINES - 3, SIDEBAR, 2, 0);
+    mainw = newwin(LINES - 3, COLS - SIDEBAR, 2, SIDEBAR);
+    statusw = newwin(1, COLS, LINES - 1, 0);
+    layout_windows();
+
+    state_readonly = 1;
+    lsp_disabled = 1;   /* a server would skew the timings and outlive us */
+    load_file(path);
+    mode = MODE_EDITOR;
+    int rows = getmaxy(mainw) - 2;
+    long frames = 0;
+    long calls = 0;
+    long cells = 0;
+    long long start = now_ms();
+    for (int top = 0; top < lines; top++) {
+        cy = rowoff = top;
+        cx = coloff = 0;
+        render_curses_calls = 0;
+        draw_editor();
+        doupdate();
+        calls += render_curses_calls;
+        for (int y = top; y < top + rows && y < lines; y++) cells += (long)strlen(buf[y]);
+        frames++;
+    }
+    long long elapsed = now_ms() - start;
+    endwin();
+    delscreen(scr);
+    fclose(out);
+    fclose(in);
+    if (frames == 0) frames = 1;
+    printf("bench-render: %s\n", path);
+    printf("  frames            %ld\n", frames);
+    printf("  ncurses calls     %.1f per frame\n", (double)calls / (double)frames);
+    printf("  visible chars     %.1f per frame\n", (double)cells / (double)frames);
+    printf("  time              %.3f ms per frame\n", (double)elapsed / (double)frames);
+    return 0;
+}
+
 /* ---------- MAIN ---------- */
 int main(int argc, char *argv[]){
     buffer_init_if_needed();
     /* Don't let a dead LSP server (broken pipe) kill the editor. */
     signal(SIGPIPE, SIG_IGN);
+    if (argc >= 3 && strcmp(argv[1], "--bench-render") == 0) {
+        return bench_render(argv[2]);
+    }
+    /* Consume our own --options so the file argument below stays argv[1]. */
+    for (int i = 1; i < argc; ) {
+        if (strncmp(argv[i], "--stats=", 8) == 0) {
+            snprintf(stats_dump_path, sizeof(stats_dump_path), "%s", argv[i] + 8);
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            if (trace_open(argv[i] + 8) != 0) {
+                fprintf(stderr, "tasci: cannot write trace file %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else {
+            i++;
+            continue;
+        }
+        for (int j = i; j < argc - 1; j++) argv[j] = argv[j + 1];
+        argc--;
+    }
     state_load();
+    /* Blinking over SSH costs a redraw every half second; default it off.
+       The default is not saved, so a later local session still blinks. */
+    if (!cursor_blink_chosen && (getenv("SSH_CONNECTION") || getenv("SSH_TTY"))) {
+        cursor_blink = CURSOR_BLINK_OFF;
+    }
     int opened_cli = 0;
     /* Handle command line arguments like nano: ts filename */
     if (argc >= 2) {
@@ -2917,7 +5894,10 @@ int main(int argc, char *argv[]){
     }
     initscr(); cbreak(); noecho(); keypad(stdscr,TRUE); curs_set(0);
     disable_flow_control();
-    timeout(MAIN_LOOP_TIMEOUT_MS);
+    nodelay(stdscr, TRUE);
+    event_init();
+    paste_enable();
+    tty_query_margins();
     /* Ask the terminal for a white cursor (blinking bar color).
        Some terminals accept BEL, others require ST. Send both. */
     printf("\033]12;white\007");
@@ -3005,179 +5985,44 @@ int main(int argc, char *argv[]){
         }
     }
     tabs_init_from_current();
-    struct timeval last_blink;
-    gettimeofday(&last_blink, NULL);
     while(1){
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        long elapsed_ms = (now.tv_sec - last_blink.tv_sec) * 1000L
-                        + (now.tv_usec - last_blink.tv_usec) / 1000L;
-        if (elapsed_ms >= 500) {
-            blink_on = !blink_on;
-            last_blink = now;
-        }
+        render_frame();
+        event_wait();
+        event_run_timers();
+        preview_collect();
         lsp_poll();
-        editor_scroll();
-        explorer_scroll();
-        draw_menu(); draw_tabs(); draw_sidebar(); draw_editor(); draw_status(status_msg);
-
-        int ch=getch();
-        if (ch == ERR) continue;
-        if(ch==KEY_RESIZE) { layout_windows(); continue; }
-        if(ch==24){ if (confirm_exit_all()) break; else continue; } // Ctrl+X
-        if(ch==19){ save_file(); }
-        if(ch==23){ set_status("Word wrap %s", soft_wrap ? "off" : "on"); soft_wrap=!soft_wrap; }
-        if(ch==KEY_F(5)){ tab_prev(); continue; }
-        if(ch==KEY_F(6)){ tab_next(); continue; }
-
-        /* ---------- EXPLORER ---------- */
-        if(mode==MODE_EXPLORER){
-            if(ch==KEY_UP && sel==0) { mode=MODE_TABS; tab_sel = tab_current; }
-            else if(ch==KEY_UP && sel>0) sel--;
-            else if(ch==KEY_DOWN && sel<file_count-1) sel++;
-            else if(ch=='\n'){
-                if(is_dir(files[sel])){
-                    if(chdir(files[sel])==0){ if(!getcwd(cwd,sizeof(cwd))) cwd[0]='\0'; load_dir(); }
-                }else{
-                    tab_open_file(files[sel]);
-                    mode=MODE_EDITOR;
-                }
-            }else if(ch==KEY_BACKSPACE||ch==127){
-                if(chdir("..")==0){ if(!getcwd(cwd,sizeof(cwd))) cwd[0]='\0'; load_dir(); }
-            }
-            else if(ch==KEY_DC || ch==4){
-                delete_selected_file();
-            }
-        }
 
-        /* ---------- MENU ---------- */
-        else if(mode==MODE_MENU){
-            if(ch==KEY_LEFT && menu_sel>0) menu_sel--;
-            else if(ch==KEY_RIGHT && menu_sel<MENU_ITEMS-1) menu_sel++;
-            else if(ch==KEY_DOWN) { mode=MODE_TABS; tab_sel = tab_current; }
-            else if(ch=='\n'){
-                switch(menu_sel){
-                    case 0: { /* Edit */
-                        const char *edit_items[] = {
-                            "Delete Line",
-                            "Paste",
-                            "Special Chars",
-                            "Replace",
-                            "Find"
-                        };
-                        int sel = popup_select("Edit", edit_items, 5);
-                        if (sel == 0) delete_line(cy);
-                        else if (sel == 1) { /* paste */
-                            int len=(int)strlen(clip);
-                            int cur=(int)strlen(buf[cy]);
-                            if (cur + len >= MAX_LINE) len = MAX_LINE - cur - 1;
-                            if (len > 0) {
-                                memmove(&buf[cy][cx+len],&buf[cy][cx],cur-cx+1);
-                                memcpy(&buf[cy][cx],clip,len); cx+=len;
-                                is_dirty = 1;
-                                lsp_send_did_change();
-                                syntax_recalc_from(cy, 1);
-                            }
-                        }
-                        else if (sel == 2) special_chars_prompt();
-                        else if (sel == 3) replace_text();
-                        else if (sel == 4) find_text();
-                        break;
-                    }
-                    case 1: /* View */
-                        soft_wrap=!soft_wrap;
-                        show_line_numbers=!show_line_numbers;
-                        set_status("Wrap %s, Line numbers %s", soft_wrap?"on":"off", show_line_numbers?"on":"off");
-                        state_save();
-                        popup("View","Theme: Soft Gray (active)\nFont: Use terminal settings");
-                        break;
-                    case 2: settings_dialog(); break;
-                    case 3: find_text(); break;
-                    case 4: shortcuts_dialog(); break;
-                    case 5: { /* File */
-                        const char *file_items[] = { "New", "Save", "Save As" };
-                        int sel = popup_select("File", file_items, 3);
-                        if (sel == 0) new_file_prompt();
-                        else if (sel == 1) save_file();
-                        else if (sel == 2) save_file_as();
-                        break;
-                    }
-                    case 6: open_external_terminal(); break;
-                    case 7: save_file(); break;
-                    case 8: save_file_as(); break;
-                    case 9: open_folder_prompt(); break;
-                    case 10: theme_menu_prompt(); break;
-                    case 11: popup("About","Open-source code editor TASCI\nCode editor made by tasic928"); break;
-                }
-            }
-            else if(ch==27) mode=MODE_EXPLORER;
-        }
-
-        /* ---------- TABS ---------- */
-        else if(mode==MODE_TABS){
-            if(ch==KEY_LEFT && tab_sel>0){ tab_sel--; tab_switch(tab_sel); }
-            else if(ch==KEY_RIGHT && tab_sel<tab_count-1){ tab_sel++; tab_switch(tab_sel); }
-            else if(ch=='\n'){ tab_switch(tab_sel); mode=MODE_EDITOR; }
-            else if(ch==KEY_DOWN){ mode=MODE_EXPLORER; }
-            else if(ch==KEY_UP){ mode=MODE_MENU; }
-            else if(ch=='x' || ch=='X' || ch==KEY_DC || ch==4){
-                tab_close(tab_sel);
-                if (tab_sel >= tab_count) tab_sel = tab_count - 1;
-            }
-            else if(ch==27) mode=MODE_EXPLORER;
+        /* Apply everything the terminal has already delivered, then draw
+           once. The cap keeps a runaway paste from starving the loop. */
+        int quit = 0;
+        int ch;
+        int batched = 0;
+        long long t_batch = 0;
+        edit_batch_begin();
+        while (!quit && batched < INPUT_BATCH_MAX && (ch = getch()) != ERR) {
+            long long t_key = stats_now_us();
+            if (batched++ == 0) t_batch = t_key;
+            stats_key_begin();
+            quit = handle_key(ch);
+            stats_key_end(t_key);
         }
-
-        /* ---------- EDITOR ---------- */
-        else if(mode==MODE_EDITOR){
-            const SyntaxLang *lang = sh_lang_for_file(current_file);
-            if (completion_active) {
-                if (ch == KEY_UP && completion_sel > 0) { completion_sel--; continue; }
-                if (ch == KEY_DOWN && completion_sel < completion_count - 1) { completion_sel++; continue; }
-                if (ch == '\n' || ch == '\t') { apply_completion(); continue; }
-                if (ch == 27) { completion_clear(); continue; }
-            }
-            if(ch==27) { completion_clear(); mode=MODE_EXPLORER; }
-            else if(ch==KEY_UP && cy>0){ completion_clear(); cy--; if(cx>(int)strlen(buf[cy])) cx=strlen(buf[cy]); }
-            else if(ch==KEY_DOWN && cy<lines-1){ completion_clear(); cy++; if(cx>(int)strlen(buf[cy])) cx=strlen(buf[cy]); }
-            else if(ch==KEY_LEFT && cx>0){ completion_clear(); cx--; }
-            else if(ch==KEY_RIGHT && cx<(int)strlen(buf[cy])){ completion_clear(); cx++; }
-            else if(ch==KEY_BACKSPACE||ch==127||ch==8){ completion_clear(); delete_char(); }
-            else if(ch==KEY_DC){ completion_clear(); delete_forward(); }
-            else if(ch=='\n'){ completion_clear(); insert_newline(); }
-            else if(isprint(ch)){
-                if (!handle_autopair(ch)) insert_char(ch);
-                completion_trigger_with_char(lang, ch);
-            }
-            else if(ch==0){ completion_trigger_with_char(lang, ' '); }
-            else if(ch==11){ /* Ctrl+K cut */
-                strncpy(clip,buf[cy],MAX_LINE-1);
-                clip[MAX_LINE-1] = '\0';
-                delete_line(cy);
-            }
-            else if(ch==21){ /* Ctrl+U paste */
-                int len=(int)strlen(clip);
-                int cur=(int)strlen(buf[cy]);
-                if (cur + len >= MAX_LINE) len = MAX_LINE - cur - 1;
-                if (len > 0) {
-                    memmove(&buf[cy][cx+len],&buf[cy][cx],cur-cx+1);
-                    memcpy(&buf[cy][cx],clip,len); cx+=len;
-                    is_dirty = 1;
-                    lsp_send_did_change();
-                    syntax_recalc_from(cy, 1);
-                }
-            }
-            else if(ch==6) find_text();
-            else if(ch==18) replace_text(); /* Ctrl+R */
-            else if(ch==1){ /* Ctrl+A */
-                cx = 0; cy = 0;
-            }
+        edit_batch_end();
+        if (quit) break;
+        if (batched) {
+            render_frame();
+            stats_record(STAT_LATENCY, stats_now_us() - t_batch);
         }
     }
 
     state_save();
-    lsp_shutdown();
+    lsp_pool_shutdown();
+    preview_worker_stop();
+    stats_dump();
+    trace_close();
     endwin();
     restore_flow_control();
+    if (decscusr_active) printf("\033[0 q");
+    printf("\033[?2004l");
     /* Reset cursor color to terminal default (BEL and ST variants). */
     printf("\033]112\007");
     printf("\033]112\033\\");
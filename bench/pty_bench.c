@@ -0,0 +1,251 @@
+/* pty_bench.c - terminal output benchmark for TASCI.
+
+   Runs the real editor under a pseudo-terminal, replays a fixed keystroke
+   script (open a file, scroll, type, search) and reports, per action, the
+   bytes the editor wrote to the terminal, the number of output bursts
+   ("frames") and the wall time until the screen went quiet.
+
+   usage: pty_bench [-r rows] [-c cols] TASCI_BINARY FILE
+
+   FILE is copied into a scratch directory, which is also used as HOME, so
+   runs neither modify the file nor pick up the user's saved state. The
+   scratch state turns the soft cursor blink off; otherwise its timer would
+   show up as output while the editor is idle. */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUIET_MS 200      /* no output for this long: the action is done */
+#define FRAME_GAP_MS 4    /* output separated by a gap this long is a new frame */
+#define KEY_GAP_MS 15     /* delay between keystrokes, roughly key repeat */
+#define ACTION_TIMEOUT_MS 10000
+
+#define KEY_DOWN  "\033OB"
+#define KEY_UP    "\033OA"
+
+/* keys is sent one keystroke at a time, repeat times over. A keystroke is
+   a single byte or a three byte ESC O x / ESC [ x sequence. */
+typedef struct {
+    const char *name;
+    const char *keys;
+    int repeat;
+} Action;
+
+typedef struct {
+    long bytes;
+    int frames;
+    double ms;
+} Result;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000L;
+}
+
+/* Read whatever the editor writes until it has been quiet for QUIET_MS,
+   counting bytes and bursts. Returns the time of the last byte. */
+static long long drain(int master, Result *res, long long last_out) {
+    char buf[65536];
+    long long deadline = now_us() + ACTION_TIMEOUT_MS * 1000LL;
+    for (;;) {
+        struct pollfd pfd = { master, POLLIN, 0 };
+        int rc = poll(&pfd, 1, QUIET_MS);
+        if (rc <= 0) break;
+        ssize_t n = read(master, buf, sizeof(buf));
+        if (n <= 0) break;
+        long long t = now_us();
+        if (t - last_out > FRAME_GAP_MS * 1000LL) res->frames++;
+        last_out = t;
+        res->bytes += n;
+        if (t > deadline) break;
+    }
+    return last_out;
+}
+
+static size_t key_len(const char *k) {
+    if (k[0] == '\033' && k[1] && k[2]) return 3;
+    return 1;
+}
+
+static int key_count(const Action *a) {
+    int n = 0;
+    for (const char *k = a->keys; *k; k += key_len(k)) n++;
+    return n * a->repeat;
+}
+
+static void run_action(int master, const Action *a, Result *res) {
+    memset(res, 0, sizeof(*res));
+    long long start = now_us();
+    long long last_out = 0;
+    const char *k = a->keys;
+    int nkeys = key_count(a);
+    for (int i = 0; i < nkeys; i++) {
+        if (!*k) k = a->keys;
+        size_t len = key_len(k);
+        ssize_t w = write(master, k, len);
+        (void)w;
+        k += len;
+        long long until = now_us() + KEY_GAP_MS * 1000LL;
+        char buf[65536];
+        for (;;) {
+            long long left = until - now_us();
+            if (left <= 0) break;
+            struct pollfd pfd = { master, POLLIN, 0 };
+            if (poll(&pfd, 1, (int)(left / 1000) + 1) <= 0) continue;
+            ssize_t n = read(master, buf, sizeof(buf));
+            if (n <= 0) break;
+            long long t = now_us();
+            if (t - last_out > FRAME_GAP_MS * 1000LL) res->frames++;
+            last_out = t;
+            res->bytes += n;
+        }
+    }
+    last_out = drain(master, res, last_out);
+    long long end = last_out > start ? last_out : start;
+    res->ms = (end - start) / 1000.0;
+}
+
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    if (!in) return -1;
+    FILE *out = fopen(to, "wb");
+    if (!out) { fclose(in); return -1; }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+    fclose(in);
+    return fclose(out);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: pty_bench [-r rows] [-c cols] TASCI_BINARY FILE\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int rows = 40, cols = 120;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:c:")) != -1) {
+        if (opt == 'r') rows = atoi(optarg);
+        else if (opt == 'c') cols = atoi(optarg);
+        else usage();
+    }
+    if (argc - optind != 2) usage();
+
+    char binary[PATH_MAX];
+    if (!realpath(argv[optind], binary)) {
+        fprintf(stderr, "pty_bench: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    const char *file = argv[optind + 1];
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+
+    char scratch[] = "/tmp/tasci-bench-XXXXXX";
+    if (!mkdtemp(scratch)) {
+        perror("pty_bench: mkdtemp");
+        return 1;
+    }
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s/%s", scratch, base);
+    if (copy_file(file, copy) != 0) {
+        fprintf(stderr, "pty_bench: cannot copy %s\n", file);
+        return 1;
+    }
+    char config[PATH_MAX], state[PATH_MAX + 16];
+    snprintf(config, sizeof(config), "%s/.config", scratch);
+    mkdir(config, 0700);
+    snprintf(config, sizeof(config), "%s/.config/tasci", scratch);
+    mkdir(config, 0700);
+    snprintf(state, sizeof(state), "%s/state.ini", config);
+    FILE *fp = fopen(state, "w");
+    if (fp) {
+        fprintf(fp, "cursor_blink=0\n");
+        fclose(fp);
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("pty_bench: posix_openpt");
+        return 1;
+    }
+    struct winsize ws = { (unsigned short)rows, (unsigned short)cols, 0, 0 };
+    const char *slave_name = ptsname(master);
+
+    long long launch = now_us();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("pty_bench: fork");
+        return 1;
+    }
+    if (pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave < 0) _exit(127);
+        ioctl(slave, TIOCSCTTY, 0);
+        ioctl(slave, TIOCSWINSZ, &ws);
+        dup2(slave, 0);
+        dup2(slave, 1);
+        dup2(slave, 2);
+        if (slave > 2) close(slave);
+        close(master);
+        if (chdir(scratch) != 0) _exit(127);
+        setenv("HOME", scratch, 1);
+        unsetenv("XDG_CONFIG_HOME");
+        setenv("TERM", "xterm-256color", 1);
+        unsetenv("SSH_CONNECTION");
+        unsetenv("SSH_TTY");
+        execl(binary, "tasci", base, (char *)NULL);
+        _exit(127);
+    }
+
+    static const Action actions[] = {
+        { "scroll down", KEY_DOWN, 80 },
+        { "scroll up",   KEY_UP, 80 },
+        { "type",        "int bench = 42; /* typed */\rchar *s = \"x\";\r", 1 },
+        { "search",      "\006main(\r", 1 },
+    };
+
+    Result res;
+    memset(&res, 0, sizeof(res));
+    long long last = drain(master, &res, 0);
+    res.ms = (last - launch) / 1000.0;
+
+    printf("%-12s %6s %10s %8s %10s\n", "action", "keys", "bytes", "frames", "wall_ms");
+    printf("%-12s %6d %10ld %8d %10.1f\n", "open", 0, res.bytes, res.frames, res.ms);
+    long total_bytes = res.bytes;
+    for (size_t i = 0; i < sizeof(actions) / sizeof(actions[0]); i++) {
+        int nkeys = key_count(&actions[i]);
+        run_action(master, &actions[i], &res);
+        printf("%-12s %6d %10ld %8d %10.1f\n", actions[i].name, nkeys, res.bytes, res.frames, res.ms);
+        total_bytes += res.bytes;
+    }
+    printf("%-12s %6s %10ld\n", "total", "", total_bytes);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(master);
+    unlink(copy);
+    unlink(state);
+    rmdir(config);
+    snprintf(config, sizeof(config), "%s/.config", scratch);
+    rmdir(config);
+    rmdir(scratch);
+    return 0;
+}
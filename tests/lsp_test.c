@@ -0,0 +1,283 @@
+/* lsp_test.c - unit tests for TASCI's LSP plumbing.
+
+   The code under test is static, so TASCI.c is compiled into this file
+   with its main() renamed. Each check prints a line only when it fails;
+   the exit status is 1 if any failed.
+
+   usage: make test */
+
+#define main tasci_main
+#include "../TASCI.c"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static LspDelta delta(int sl, int sc, int el, int ec, const char *text) {
+    LspDelta d;
+    d.start_line = sl;
+    d.start_col = sc;
+    d.end_line = el;
+    d.end_col = ec;
+    d.len = strlen(text);
+    d.text = (char *)malloc(d.len + 1);
+    memcpy(d.text, text, d.len + 1);
+    return d;
+}
+
+static int delta_is(const LspDelta *d, int sl, int sc, int el, int ec, const char *text) {
+    return d->start_line == sl && d->start_col == sc && d->end_line == el &&
+           d->end_col == ec && strcmp(d->text, text) == 0;
+}
+
+/* ---------- lsp_delta_merge ---------- */
+
+static void test_delta_merge(void) {
+    LspDelta d;
+
+    /* Typing right after the queued text extends it. */
+    d = delta(0, 0, 0, 0, "a");
+    CHECK(lsp_delta_merge(&d, 0, 1, 0, 1, "b", 1));
+    CHECK(delta_is(&d, 0, 0, 0, 0, "ab"));
+    free(d.text);
+
+    /* Text across a newline: the end is on the next line. */
+    d = delta(2, 4, 2, 4, "x\ny");
+    CHECK(lsp_delta_merge(&d, 3, 1, 3, 1, "z", 1));
+    CHECK(delta_is(&d, 2, 4, 2, 4, "x\nyz"));
+    free(d.text);
+
+    /* An insertion elsewhere, or inside the queued text, stays separate. */
+    d = delta(0, 0, 0, 0, "abc");
+    CHECK(!lsp_delta_merge(&d, 0, 5, 0, 5, "z", 1));
+    CHECK(!lsp_delta_merge(&d, 0, 1, 0, 1, "z", 1));
+    CHECK(delta_is(&d, 0, 0, 0, 0, "abc"));
+    free(d.text);
+
+    /* Forward delete right after the text widens the replaced range. */
+    d = delta(0, 0, 0, 0, "x");
+    CHECK(lsp_delta_merge(&d, 0, 1, 0, 2, "", 0));
+    CHECK(delta_is(&d, 0, 0, 0, 1, "x"));
+    free(d.text);
+
+    /* Forward delete of a line break joins the range onto the next line. */
+    d = delta(0, 3, 0, 3, "");
+    CHECK(lsp_delta_merge(&d, 0, 3, 1, 0, "", 0));
+    CHECK(delta_is(&d, 0, 3, 1, 0, ""));
+    free(d.text);
+
+    /* Backspacing over typed text shortens it. */
+    d = delta(0, 0, 0, 0, "ab");
+    CHECK(lsp_delta_merge(&d, 0, 1, 0, 2, "", 0));
+    CHECK(delta_is(&d, 0, 0, 0, 0, "a"));
+    free(d.text);
+
+    /* Backspacing past its start takes the text and moves the start back. */
+    d = delta(0, 3, 0, 3, "ab");
+    CHECK(lsp_delta_merge(&d, 0, 2, 0, 5, "", 0));
+    CHECK(delta_is(&d, 0, 2, 0, 3, ""));
+    free(d.text);
+
+    /* A deletion ending where the range starts only widens it. */
+    d = delta(0, 5, 0, 6, "");
+    CHECK(lsp_delta_merge(&d, 0, 4, 0, 5, "", 0));
+    CHECK(delta_is(&d, 0, 4, 0, 6, ""));
+    free(d.text);
+
+    /* Overlapping the range without touching its ends does not merge. */
+    d = delta(0, 5, 0, 6, "q");
+    CHECK(!lsp_delta_merge(&d, 0, 4, 0, 7, "", 0));
+    CHECK(delta_is(&d, 0, 5, 0, 6, "q"));
+    free(d.text);
+}
+
+/* ---------- JSON ---------- */
+
+static JsonCur cur(const char *s) {
+    JsonCur c = { s, s + strlen(s), 0 };
+    return c;
+}
+
+static void test_json_string(void) {
+    char out[64];
+    JsonCur c;
+
+    c = cur("\"a\\\"b\\\\c\\/d\\n\\t\"");
+    CHECK(json_string(&c, out, sizeof(out)) && strcmp(out, "a\"b\\c/d\n\t") == 0);
+
+    /* \u escapes: one, two and three byte sequences, then a surrogate
+       pair, which is one four byte sequence. */
+    c = cur("\"\\u0041\\u00e9\\u20AC\\ud83d\\ude00\"");
+    CHECK(json_string(&c, out, sizeof(out)) &&
+          strcmp(out, "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80") == 0);
+
+    /* Lone surrogates, high or low, become U+FFFD. */
+    c = cur("\"\\ud83dx\"");
+    CHECK(json_string(&c, out, sizeof(out)) && strcmp(out, "\xef\xbf\xbdx") == 0);
+    c = cur("\"\\ude00\\ud83d\\u0041\"");
+    CHECK(json_string(&c, out, sizeof(out)) && strcmp(out, "\xef\xbf\xbd\xef\xbf\xbd" "A") == 0);
+
+    /* Too long: cut to fit, never in the middle of a sequence. */
+    c = cur("\"abcdef\"");
+    CHECK(json_string(&c, out, 4) && strcmp(out, "abc") == 0);
+    c = cur("\"ab\\u00e9\"");
+    CHECK(json_string(&c, out, 4) && strcmp(out, "ab") == 0);
+
+    c = cur("\"open");
+    CHECK(!json_string(&c, out, sizeof(out)) && c.err);
+}
+
+static void test_json_skip(void) {
+    JsonCur c;
+    int v = 0;
+    const char *key;
+    size_t klen;
+
+    /* Brackets inside strings do not count towards nesting. */
+    c = cur("{\"a\":[1,{\"b\":\"}]\\\"\"},[[]]],\"n\":7}");
+    CHECK(json_expect(&c, '{'));
+    CHECK(json_member(&c, &key, &klen) && json_key(key, klen, "a"));
+    json_skip(&c);
+    CHECK(json_member(&c, &key, &klen) && json_key(key, klen, "n"));
+    CHECK(json_int(&c, &v) && v == 7);
+    CHECK(!json_member(&c, &key, &klen) && !c.err);
+
+    /* Scalars end at a delimiter or space. */
+    c = cur("true ,null]");
+    json_skip(&c);
+    CHECK(json_peek(&c) == ',' && !c.err);
+
+    /* Truncated input stops the walk with an error instead of reading on. */
+    c = cur("{\"a\":[1,{\"b\":");
+    json_skip(&c);
+    CHECK(c.err && c.p == c.end);
+    c = cur("[\"x\",\"y");
+    json_skip(&c);
+    CHECK(c.err);
+}
+
+static void test_json_completions(void) {
+    LspEvent ev;
+    JsonCur c;
+
+    memset(&ev, 0, sizeof(ev));
+    c = cur("{\"isIncomplete\":true,\"items\":[{\"detail\":{\"n\":[1,{\"x\":\"}]\"}]},\"label\":\"print\"},"
+            "{\"label\":\"puts\"},{\"label\":\"pri\\u006et_x\"},7]}");
+    lsp_parse_completions(&c, "pri", &ev);
+    CHECK(!c.err && ev.incomplete && ev.count == 2);
+    CHECK(ev.count == 2 && strcmp(ev.items[0], "print") == 0 && strcmp(ev.items[1], "print_x") == 0);
+    free(ev.items);
+
+    /* Items before the cut are kept; the rest of the message is dropped. */
+    memset(&ev, 0, sizeof(ev));
+    c = cur("[{\"label\":\"abc\"},{\"label\":\"ab");
+    lsp_parse_completions(&c, NULL, &ev);
+    CHECK(c.err && ev.count == 1 && strcmp(ev.items[0], "abc") == 0);
+    free(ev.items);
+}
+
+/* ---------- Content-Length framing ---------- */
+
+static void test_content_length(void) {
+    const char *h;
+
+    h = "Content-Length: 42\r\n\r\n";
+    CHECK(lsp_content_length(h, h + strlen(h)) == 42);
+    h = "Content-Type: application/vscode-jsonrpc\r\ncontent-length:7\r\n\r\n";
+    CHECK(lsp_content_length(h, h + strlen(h)) == 7);
+    h = "Content-Type: x\r\n\r\n";
+    CHECK(lsp_content_length(h, h + strlen(h)) == -1);
+}
+
+static void write_all(int fd, const char *s) {
+    size_t n = strlen(s);
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w <= 0) return;
+        s += w;
+        n -= (size_t)w;
+    }
+}
+
+static void expect_id(LspIo *io, int id, int kind, const char *prefix) {
+    LspExpect *e = (LspExpect *)calloc(1, sizeof(*e));
+    e->id = id;
+    e->kind = kind;
+    if (prefix) snprintf(e->prefix, sizeof(e->prefix), "%s", prefix);
+    lsp_ring_push(&io->to_io, e);
+}
+
+static void test_framing(void) {
+    static LspIo io;
+    int fds[2];
+    if (pipe(fds) != 0) {
+        CHECK(!"pipe");
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    io.out_fd = fds[0];
+    io.stop_pipe[0] = io.stop_pipe[1] = -1;
+    expect_id(&io, 1, LSP_REQ_INIT, NULL);
+    expect_id(&io, 2, LSP_REQ_COMPLETION, "ab");
+
+    const char *init = "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":{\"capabilities\":"
+                       "{\"positionEncoding\":\"utf-8\",\"textDocumentSync\":2}}}";
+    const char *done = "{\"result\":[{\"label\":\"abc\"}],\"jsonrpc\":\"2.0\",\"id\":2}";
+    char msg[512];
+
+    /* Split inside the header, then inside the body: nothing is handled
+       until the whole message is in. */
+    snprintf(msg, sizeof(msg), "Content-Length: %zu\r\n\r\n%s", strlen(init), init);
+    char first[16];
+    memcpy(first, msg, 10);
+    first[10] = '\0';
+    write_all(fds[1], first);
+    CHECK(lsp_io_read(&io) && lsp_ring_pop(&io.to_ui) == NULL);
+    char middle[64];
+    snprintf(middle, sizeof(middle), "%.40s", msg + 10);
+    write_all(fds[1], middle);
+    CHECK(lsp_io_read(&io) && lsp_ring_pop(&io.to_ui) == NULL);
+
+    /* The rest, a header block without a length, which is dropped, and a
+       second message whose result comes before its id, all in one read. */
+    write_all(fds[1], msg + 10 + strlen(middle));
+    write_all(fds[1], "Content-Type: x\r\n\r\n");
+    snprintf(msg, sizeof(msg), "content-length: %zu\r\n\r\n%s", strlen(done), done);
+    write_all(fds[1], msg);
+    CHECK(lsp_io_read(&io));
+    CHECK(io.rlen == 0);
+
+    LspEvent *ev = (LspEvent *)lsp_ring_pop(&io.to_ui);
+    CHECK(ev && ev->kind == LSP_EV_INIT && ev->id == 1);
+    CHECK(ev && ev->sync_kind == LSP_SYNC_INCREMENTAL && ev->utf8_positions);
+    if (ev) lsp_event_free(ev);
+    ev = (LspEvent *)lsp_ring_pop(&io.to_ui);
+    CHECK(ev && ev->kind == LSP_EV_COMPLETION && ev->id == 2);
+    CHECK(ev && ev->count == 1 && strcmp(ev->items[0], "abc") == 0);
+    if (ev) lsp_event_free(ev);
+    CHECK(lsp_ring_pop(&io.to_ui) == NULL);
+
+    /* A closed pipe ends the reader. */
+    close(fds[1]);
+    CHECK(!lsp_io_read(&io));
+    close(fds[0]);
+    free(io.rbuf);
+}
+
+int main(void) {
+    test_delta_merge();
+    test_json_string();
+    test_json_skip();
+    test_json_completions();
+    test_content_length();
+    test_framing();
+    if (failures) fprintf(stderr, "%d check(s) failed\n", failures);
+    else printf("lsp_test: all checks passed\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_MAX_THREADS 8       /* rings; slot 0 is the thread that opened the trace */
+#define TRACE_RING_EVENTS 65536   /* per ring; the oldest are overwritten */
+
+typedef struct {
+    const char *name;
+    long long start_us;
+    long long dur_us;
+} TraceEvent;
+
+/* Written only by its owning thread; head is published with release
+   ordering so trace_close() sees complete events. A thread gives its ring
+   back on exit, and the next thread of the same name takes it over, so
+   respawned workers continue one row instead of using up slots. */
+typedef struct {
+    TraceEvent *events;
+    unsigned long head;
+    int tid;
+    int busy;               /* owned by a running thread */
+    char thread_name[32];
+} TraceRing;
+
+int trace_enabled = 0;
+
+static char trace_path[4096];
+static TraceRing trace_rings[TRACE_MAX_THREADS];
+static int trace_ring_count = 0;
+static unsigned long trace_dropped = 0;   /* events from threads without a ring */
+static __thread TraceRing *trace_ring_self = NULL;
+
+long long trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000L;
+}
+
+/* A released ring last owned by a thread called name, else a new one. */
+static TraceRing *trace_ring_claim(const char *name) {
+    int count = __atomic_load_n(&trace_ring_count, __ATOMIC_ACQUIRE);
+    if (count > TRACE_MAX_THREADS) count = TRACE_MAX_THREADS;
+    for (int i = 0; name && i < count; i++) {
+        TraceRing *r = &trace_rings[i];
+        int free_ring = 0;
+        if (!__atomic_load_n(&r->events, __ATOMIC_ACQUIRE) ||
+            !__atomic_compare_exchange_n(&r->busy, &free_ring, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        if (strcmp(r->thread_name, name) == 0) return r;
+        __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+    }
+    int slot = __atomic_fetch_add(&trace_ring_count, 1, __ATOMIC_ACQ_REL);
+    TraceEvent *events = slot < TRACE_MAX_THREADS ? calloc(TRACE_RING_EVENTS, sizeof(TraceEvent)) : NULL;
+    if (!events) return NULL;
+    TraceRing *r = &trace_rings[slot];
+    r->tid = slot + 1;
+    r->busy = 1;
+    snprintf(r->thread_name, sizeof(r->thread_name), "thread %d", r->tid);
+    __atomic_store_n(&r->events, events, __ATOMIC_RELEASE);
+    return r;
+}
+
+static TraceRing *trace_ring_get(void) {
+    if (!trace_ring_self) trace_ring_self = trace_ring_claim(NULL);
+    return trace_ring_self;
+}
+
+/* Call from the main thread before starting any that trace: it gets the
+   first ring, so it is never the one left without. */
+int trace_open(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fclose(fp);
+    snprintf(trace_path, sizeof(trace_path), "%s", path);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+    trace_thread_name("main");
+    return 0;
+}
+
+void trace_thread_name(const char *name) {
+    if (!TRACE_ON()) return;
+    if (!trace_ring_self) trace_ring_self = trace_ring_claim(name);
+    TraceRing *r = trace_ring_self;
+    if (r) snprintf(r->thread_name, sizeof(r->thread_name), "%s", name);
+}
+
+void trace_thread_exit(void) {
+    TraceRing *r = trace_ring_self;
+    if (!r) return;
+    trace_ring_self = NULL;
+    __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+}
+
+void trace_event(const char *name, long long start_us, long long end_us) {
+    if (!TRACE_ON()) return;
+    TraceRing *r = trace_ring_get();
+    if (!r) {
+        __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned long head = r->head;
+    TraceEvent *e = &r->events[head % TRACE_RING_EVENTS];
+    e->name = name;
+    e->start_us = start_us;
+    e->dur_us = end_us - start_us;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_scope_end(TraceScope *scope) {
+    if (scope->start_us && TRACE_ON()) trace_event(scope->name, scope->start_us, trace_now_us());
+}
+
+static void trace_write_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', fp);
+        if ((unsigned char)*s >= 0x20) fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Writes each ring up to the head it published; a thread still recording
+   could overwrite the oldest events mid-write, hence joining them first.
+   Events lost to a full ring or to a thread without one are counted in
+   otherData. */
+void trace_close(void) {
+    if (!TRACE_ON()) return;
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+    FILE *fp = fopen(trace_path, "w");
+    if (!fp) return;
+    int pid = (int)getpid();
+    int first = 1;
+    int count = __atomic_load_n(&trace_ring_count, __ATOMIC_ACQUIRE);
+    if (count > TRACE_MAX_THREADS) count = TRACE_MAX_THREADS;
+    unsigned long overwritten = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+    for (int i = 0; i < count; i++) {
+        TraceRing *r = &trace_rings[i];
+        TraceEvent *events = __atomic_load_n(&r->events, __ATOMIC_ACQUIRE);
+        if (!events) continue;
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                first ? "" : ",\n", pid, r->tid);
+        trace_write_string(fp, r->thread_name);
+        fputs("}}", fp);
+        first = 0;
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long from = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        overwritten += from;
+        for (unsigned long n = from; n < head; n++) {
+            const TraceEvent *e = &events[n % TRACE_RING_EVENTS];
+            fputs(",\n{\"name\":", fp);
+            trace_write_string(fp, e->name);
+            fprintf(fp, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+                    e->start_us, e->dur_us, pid, r->tid);
+        }
+    }
+    fprintf(fp, "\n],\"otherData\":{\"overwritten_events\":%lu,\"dropped_events\":%lu}}\n",
+            overwritten, __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED));
+    fclose(fp);
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Scoped event tracing for --trace=FILE, written as Chrome trace JSON
+   (chrome://tracing, ui.perfetto.dev). Each thread records into its own
+   ring buffer without locks; trace_close() writes everything out, and must
+   run after the other threads that trace have been joined. */
+
+/* Read from every thread; use TRACE_ON() rather than the variable. */
+extern int trace_enabled;
+#define TRACE_ON() __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)
+
+int trace_open(const char *path);
+void trace_close(void);
+void trace_thread_name(const char *name);
+/* Give the thread's ring back; call last thing in a thread that traced. */
+void trace_thread_exit(void);
+
+long long trace_now_us(void);
+void trace_event(const char *name, long long start_us, long long end_us);
+
+typedef struct {
+    const char *name;
+    long long start_us;
+} TraceScope;
+
+void trace_scope_end(TraceScope *scope);
+
+/* Record an event from here to the end of the enclosing block. name must be
+   a string literal (only the pointer is stored). */
+#define TRACE_SCOPE(name) \
+    TraceScope trace_scope_ __attribute__((cleanup(trace_scope_end))) = \
+        { (name), TRACE_ON() ? trace_now_us() : 0 }
+
+#endif